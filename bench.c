@@ -0,0 +1,503 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <glob.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "mpc.h"
+
+// Benchmark harness. Runs every workload with the prompt binary and prints
+// the results as JSON, so they can be compared between commits.
+//
+// Usage: bench [-p prompt] [-r runs] [--prompt-option ...] [workload ...]
+//        bench -m 1,10,100
+//        bench [-p prompt] [--prompt-option ...] -s forms
+//
+// Options starting with -- are passed to prompt, for example --engine=vm.
+// Workloads default to benchmarks/*.lspy. Each one starts with the line
+// '; ops N' giving the number of operations it performs. Time and
+// allocations of prompt loading an empty file are subtracted before
+// dividing by it.
+//
+// With -m the Lispy grammar is run directly by mpc_parse, mpc_parse_file
+// and mpc_parse_pipe on generated sources of the given sizes in megabytes.
+//
+// With -s the given number of forms is piped through 'prompt -'. The
+// throughput is measured with all forms written at once, the latency by
+// waiting for the output of each form before sending the next one.
+
+#define BENCH_MAX_OPTS 16
+
+typedef struct bench_result
+{
+  // Fastest of the runs
+  double seconds;
+  long allocs;
+  long collections;
+  // Largest of the runs, in kilobytes
+  long peak_rss;
+  int ok;
+} bench_result;
+
+char* bench_prompt = "./prompt";
+char* bench_opts[BENCH_MAX_OPTS];
+int bench_nopts = 0;
+int bench_runs = 5;
+
+double bench_now(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// Run prompt on file once, counters are read from its --stats line
+void bench_run_once(char* file, bench_result* r)
+{
+  int err[2];
+  if (pipe(err) != 0) { r->ok = 0; return; }
+
+  double start = bench_now();
+  pid_t pid = fork();
+  if (pid == 0)
+    {
+      char* argv[BENCH_MAX_OPTS + 4];
+      int argc = 0;
+      argv[argc++] = bench_prompt;
+      for (int i = 0; i < bench_nopts; i++) { argv[argc++] = bench_opts[i]; }
+      argv[argc++] = "--stats";
+      argv[argc++] = file;
+      argv[argc] = NULL;
+
+      int null = open("/dev/null", O_WRONLY);
+      dup2(null, STDOUT_FILENO);
+      dup2(err[1], STDERR_FILENO);
+      close(err[0]);
+      execv(bench_prompt, argv);
+      _exit(127);
+    }
+  close(err[1]);
+
+  char buffer[4096];
+  size_t len = 0;
+  ssize_t n;
+  while ((n = read(err[0], buffer + len, sizeof(buffer) - 1 - len)) > 0)
+    {
+      len += n;
+      // Keep the tail, the stats line is the last one
+      if (len == sizeof(buffer) - 1)
+        {
+          memmove(buffer, buffer + len / 2, len - len / 2);
+          len -= len / 2;
+        }
+    }
+  buffer[len] = '\0';
+  close(err[0]);
+
+  int status;
+  struct rusage usage;
+  wait4(pid, &status, 0, &usage);
+  double seconds = bench_now() - start;
+
+  long allocs = 0;
+  long collections = 0;
+  char* line = strstr(buffer, "allocs ");
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || !line
+      || sscanf(line, "allocs %li collections %li", &allocs, &collections) != 2)
+    {
+      r->ok = 0;
+      return;
+    }
+
+#ifdef __APPLE__
+  long rss = usage.ru_maxrss / 1024;
+#else
+  long rss = usage.ru_maxrss;
+#endif
+  if (seconds < r->seconds) { r->seconds = seconds; }
+  if (rss > r->peak_rss) { r->peak_rss = rss; }
+  r->allocs = allocs;
+  r->collections = collections;
+}
+
+bench_result bench_run(char* file)
+{
+  bench_result r = { 1e30, 0, 0, 0, 1 };
+  for (int i = 0; i < bench_runs && r.ok; i++) { bench_run_once(file, &r); }
+  return r;
+}
+
+// Operation count from the first line of workload, 0 if missing
+long bench_ops(char* file)
+{
+  FILE* f = fopen(file, "r");
+  if (!f) { return 0; }
+  long ops = 0;
+  if (fscanf(f, " ; ops %li", &ops) != 1) { ops = 0; }
+  fclose(f);
+  return ops;
+}
+
+void bench_print_string(char* s)
+{
+  putchar('"');
+  for (; *s; s++)
+    {
+      if (*s == '"' || *s == '\\') { putchar('\\'); }
+      putchar(*s);
+    }
+  putchar('"');
+}
+
+// Source of about n bytes mixing all kinds of tokens
+char* bench_source(long n)
+{
+  char* s = malloc(n + 256);
+  long len = 0;
+  for (int i = 0; len < n; i++)
+    {
+      len += sprintf(s + len,
+                     "(def {f%i} (\\ {x y} {\n"
+                     "  if (> x %i) {+ x y -%i} {join {a \"str %i\"} (list True)}\n"
+                     "  })) ; comment %i\n", i, i, i, i, i);
+    }
+  return s;
+}
+
+typedef int(*bench_parser)(char* file, char* source, mpc_parser_t* p,
+                           mpc_result_t* r);
+
+int bench_parse_string(char* file, char* source, mpc_parser_t* p, mpc_result_t* r)
+{
+  return mpc_parse(file, source, p, r);
+}
+
+int bench_parse_file(char* file, char* source, mpc_parser_t* p, mpc_result_t* r)
+{
+  FILE* f = fopen(file, "rb");
+  int ok = mpc_parse_file(file, f, p, r);
+  fclose(f);
+  return ok;
+}
+
+int bench_parse_pipe(char* file, char* source, mpc_parser_t* p, mpc_result_t* r)
+{
+  char command[512];
+  snprintf(command, sizeof(command), "cat '%s'", file);
+  FILE* f = popen(command, "r");
+  int ok = mpc_parse_pipe(file, f, p, r);
+  pclose(f);
+  return ok;
+}
+
+// Time of parsing sources of given sizes with each input type of mpc
+int bench_parse(char* sizes)
+{
+  // Same grammar as main in lispy.c
+  mpc_parser_t* Number  = mpc_new("number");
+  mpc_parser_t* Boolean = mpc_new("boolean");
+  mpc_parser_t* String  = mpc_new("string");
+  mpc_parser_t* Comment = mpc_new("comment");
+  mpc_parser_t* Symbol  = mpc_new("symbol");
+  mpc_parser_t* Sexpr   = mpc_new("sexpr");
+  mpc_parser_t* Qexpr   = mpc_new("qexpr");
+  mpc_parser_t* Expr    = mpc_new("expr");
+  mpc_parser_t* Lispy   = mpc_new("lispy");
+  mpca_lang(MPCA_LANG_DEFAULT,
+            "                                                   \
+              number : /-?[0-9]+/;                              \
+              boolean : /True|False/;                           \
+              string  : /\"(\\\\.|[^\"\\\\])*\"/ ;              \
+              comment : /;[^\\r\\n]*/ ;                         \
+              symbol: /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/;         \
+              sexpr  : '(' <expr>* ')';                         \
+              qexpr  : '{' <expr>* '}';                         \
+              expr   : <number>  | <boolean> | <string> |       \
+                       <comment> | <symbol> | <sexpr> |         \
+                       <qexpr>;                                 \
+              lispy  : /^/ <expr>* /$/;                         \
+            ",
+            Number, Boolean, String, Comment, Symbol, Sexpr, Qexpr, Expr, Lispy);
+
+  char* names[] = { "mpc_parse", "mpc_parse_file", "mpc_parse_pipe" };
+  bench_parser parsers[] = { bench_parse_string, bench_parse_file,
+                             bench_parse_pipe };
+  char file[] = "/tmp/bench-parse-XXXXXX";
+  int fd = mkstemp(file);
+  if (fd < 0)
+    {
+      fprintf(stderr, "Cannot create temporary file\n");
+      return 1;
+    }
+  close(fd);
+
+  int failed = 0;
+  int first = 1;
+  printf("{\n  \"parse\": [\n");
+  for (char* s = sizes; *s; )
+    {
+      char* next;
+      long mb = strtol(s, &next, 10);
+      if (next == s) { break; }
+      for (s = next; *s == ','; s++) { }
+      if (mb <= 0) { continue; }
+
+      char* source = bench_source(mb * 1024 * 1024);
+      FILE* f = fopen(file, "wb");
+      fputs(source, f);
+      fclose(f);
+
+      for (int i = 0; i < 3; i++)
+        {
+          mpc_result_t r;
+          double start = bench_now();
+          int ok = parsers[i](file, source, Lispy, &r);
+          double seconds = bench_now() - start;
+          if (ok) { mpc_ast_delete(r.output); }
+          else
+            {
+              mpc_err_delete(r.error);
+              failed = 1;
+            }
+
+          printf("%s    {\"api\": \"%s\", \"mb\": %li, ", first ? "" : ",\n",
+                 names[i], mb);
+          if (ok)
+            {
+              printf("\"seconds\": %.3f, \"ns_per_byte\": %.1f}", seconds,
+                     seconds * 1e9 / strlen(source));
+            }
+          else { printf("\"error\": \"parse failed\"}"); }
+          first = 0;
+          fflush(stdout);
+        }
+      free(source);
+    }
+  printf("\n  ]\n}\n");
+
+  unlink(file);
+  mpc_cleanup(9, Number, Boolean, String, Comment, Symbol, Sexpr, Qexpr, Expr,
+              Lispy);
+  return failed;
+}
+
+// Starts 'prompt -' reading from in, with stdout to out or /dev/null
+pid_t bench_filter(int in, int out)
+{
+  pid_t pid = fork();
+  if (pid == 0)
+    {
+      char* argv[BENCH_MAX_OPTS + 3];
+      int argc = 0;
+      argv[argc++] = bench_prompt;
+      for (int i = 0; i < bench_nopts; i++) { argv[argc++] = bench_opts[i]; }
+      argv[argc++] = "-";
+      argv[argc] = NULL;
+
+      if (out < 0) { out = open("/dev/null", O_WRONLY); }
+      dup2(in, STDIN_FILENO);
+      dup2(out, STDOUT_FILENO);
+      execv(bench_prompt, argv);
+      _exit(127);
+    }
+  return pid;
+}
+
+// Seconds to pipe n forms through prompt, or a negative number on failure
+double bench_stream_run(long n)
+{
+  int in[2];
+  if (pipe(in) != 0) { return -1; }
+  // The filter must not hold the write end open or it never sees EOF
+  fcntl(in[1], F_SETFD, FD_CLOEXEC);
+  double start = bench_now();
+  pid_t pid = bench_filter(in[0], -1);
+  close(in[0]);
+
+  FILE* w = fdopen(in[1], "w");
+  for (long i = 0; i < n; i++) { fprintf(w, "(print (+ %li 1))\n", i); }
+  fclose(w);
+
+  int status;
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) { return -1; }
+  return bench_now() - start;
+}
+
+// Mean seconds from sending a form to reading its output over n forms
+double bench_stream_latency(long n)
+{
+  int in[2];
+  int out[2];
+  if (pipe(in) != 0) { return -1; }
+  if (pipe(out) != 0) { return -1; }
+  fcntl(in[1], F_SETFD, FD_CLOEXEC);
+  fcntl(out[0], F_SETFD, FD_CLOEXEC);
+  pid_t pid = bench_filter(in[0], out[1]);
+  close(in[0]);
+  close(out[1]);
+
+  double total = 0;
+  int ok = 1;
+  for (long i = 0; i < n && ok; i++)
+    {
+      char form[64];
+      int len = snprintf(form, sizeof(form), "(print (+ %li 1))\n", i);
+      double start = bench_now();
+      if (write(in[1], form, len) != len) { ok = 0; }
+      // Output is one line per form
+      char c = '\0';
+      while (ok && c != '\n') { ok = read(out[0], &c, 1) == 1; }
+      total += bench_now() - start;
+    }
+  close(in[1]);
+  close(out[0]);
+
+  int status;
+  waitpid(pid, &status, 0);
+  if (!ok || !WIFEXITED(status) || WEXITSTATUS(status) != 0) { return -1; }
+  return total / n;
+}
+
+// Throughput and latency of prompt as a filter
+int bench_stream(long forms)
+{
+  // Startup is measured with no forms and subtracted
+  double base = 1e30;
+  double seconds = 1e30;
+  for (int i = 0; i < bench_runs; i++)
+    {
+      double t = bench_stream_run(0);
+      if (t >= 0 && t < base) { base = t; }
+      t = bench_stream_run(forms);
+      if (t >= 0 && t < seconds) { seconds = t; }
+    }
+  // Each form waits for the one before it, so fewer are needed
+  long latency_forms = forms < 1000 ? forms : 1000;
+  double latency = bench_stream_latency(latency_forms);
+
+  if (base == 1e30 || seconds == 1e30 || latency < 0)
+    {
+      fprintf(stderr, "Cannot run '%s -'\n", bench_prompt);
+      return 1;
+    }
+
+  double ns = (seconds - base) * 1e9 / forms;
+  printf("{\n  \"prompt\": ");
+  bench_print_string(bench_prompt);
+  printf(",\n  \"options\": [");
+  for (int i = 0; i < bench_nopts; i++)
+    {
+      if (i) { printf(", "); }
+      bench_print_string(bench_opts[i]);
+    }
+  printf("],\n  \"stream\": {\"forms\": %li, \"ns_per_form\": %.1f, "
+         "\"forms_per_second\": %.0f, \"latency_us\": %.1f}\n}\n",
+         forms, ns > 0 ? ns : 0, ns > 0 ? 1e9 / ns : 0, latency * 1e6);
+  return 0;
+}
+
+int main(int argc, char** argv)
+{
+  char** files = malloc(sizeof(char*) * argc);
+  int nfiles = 0;
+  long stream = 0;
+  for (int i = 1; i < argc; i++)
+    {
+      if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) { return bench_parse(argv[++i]); }
+      else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+        {
+          stream = atol(argv[++i]);
+          if (stream < 1) { stream = 1; }
+        }
+      else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) { bench_prompt = argv[++i]; }
+      else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+        {
+          bench_runs = atoi(argv[++i]);
+          if (bench_runs < 1) { bench_runs = 1; }
+        }
+      else if (strncmp(argv[i], "--", 2) == 0)
+        {
+          if (bench_nopts == BENCH_MAX_OPTS)
+            {
+              fprintf(stderr, "Too many prompt options\n");
+              return 1;
+            }
+          bench_opts[bench_nopts++] = argv[i];
+        }
+      else { files[nfiles++] = argv[i]; }
+    }
+  if (stream)
+    {
+      free(files);
+      return bench_stream(stream);
+    }
+
+  glob_t g;
+  g.gl_pathc = 0;
+  if (nfiles == 0)
+    {
+      if (glob("benchmarks/*.lspy", 0, NULL, &g) == 0)
+        {
+          files = realloc(files, sizeof(char*) * g.gl_pathc);
+          for (size_t i = 0; i < g.gl_pathc; i++) { files[nfiles++] = g.gl_pathv[i]; }
+        }
+    }
+  if (nfiles == 0)
+    {
+      fprintf(stderr, "No workloads\n");
+      return 1;
+    }
+
+  bench_result base = bench_run("/dev/null");
+  if (!base.ok)
+    {
+      fprintf(stderr, "Cannot run '%s'\n", bench_prompt);
+      return 1;
+    }
+
+  printf("{\n  \"prompt\": ");
+  bench_print_string(bench_prompt);
+  printf(",\n  \"options\": [");
+  for (int i = 0; i < bench_nopts; i++)
+    {
+      if (i) { printf(", "); }
+      bench_print_string(bench_opts[i]);
+    }
+  printf("],\n  \"runs\": %i,\n", bench_runs);
+  printf("  \"startup\": {\"ns\": %.0f, \"allocs\": %li, \"peak_rss_kb\": %li},\n",
+         base.seconds * 1e9, base.allocs, base.peak_rss);
+  printf("  \"workloads\": [\n");
+
+  int failed = 0;
+  for (int i = 0; i < nfiles; i++)
+    {
+      long ops = bench_ops(files[i]);
+      bench_result r = bench_run(files[i]);
+      printf("    {\"name\": ");
+      bench_print_string(files[i]);
+      printf(", \"ops\": %li, ", ops);
+      if (!r.ok || ops <= 0)
+        {
+          printf("\"error\": \"%s\"}", ops <= 0 ? "missing ops" : "run failed");
+          failed = 1;
+        }
+      else
+        {
+          double ns = (r.seconds - base.seconds) * 1e9 / ops;
+          double allocs = (double) (r.allocs - base.allocs) / ops;
+          printf("\"ns_per_op\": %.1f, \"allocs_per_op\": %.2f, "
+                 "\"collections\": %li, \"peak_rss_kb\": %li}",
+                 ns > 0 ? ns : 0, allocs, r.collections, r.peak_rss);
+        }
+      printf("%s\n", i + 1 < nfiles ? "," : "");
+    }
+  printf("  ]\n}\n");
+
+  if (g.gl_pathc) { globfree(&g); }
+  free(files);
+  return failed;
+}
@@ -1,7 +1,19 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <setjmp.h>
+#include <time.h>
 #include "mpc.h"
 
+// Vector kernels of the numeric reductions, see lreduce
+#if defined(__GNUC__) && defined(__x86_64__)
+#define LREDUCE_SIMD
+#include <immintrin.h>
+#endif
+
 
 #define LASSERT(args, cond, fmt, ...)                           \
   if (!(cond))                                                  \
@@ -18,12 +30,41 @@
           func, args->count, num);                                      \
 
 #define LASSERT_TYPE(func, args, index, expect)                         \
-  LASSERT(args, args->cell[index]->type == expect,                      \
+  LASSERT(args, LTYPE(args->cell[index]) == expect,                      \
           "Function '%s' passed incorrect type. "                       \
           "Got %s, Exptected %s",                                       \
-          func, ltype_name(args->cell[index]->type),                    \
+          func, ltype_name(LTYPE(args->cell[index])),                    \
           ltype_name(expect));                                          \
 
+// Orderings take a number and a number or boolean
+#define LASSERT_ORD(func, args)                                         \
+  LASSERT_NUM(func, args, 2);                                           \
+  LASSERT(args, LVAL_NUMERIC(args->cell[0]),                            \
+          "Function '%s' passed incorrect type. "                       \
+          "Got %s, Exptected %s",                                       \
+          func, ltype_name(LTYPE(args->cell[0])),                       \
+          ltype_name(LVAL_NUM));                                        \
+  LASSERT(args, LVAL_NUMERIC(args->cell[1])                             \
+          || LTYPE(args->cell[1]) == LVAL_BOOL,                         \
+          "Function '%s' passed incorrect type. "                       \
+          "Got %s, Exptected %s or %s",                                 \
+          func, ltype_name(LTYPE(args->cell[1])),                       \
+          ltype_name(LVAL_BOOL), ltype_name(LVAL_NUM));                 \
+
+// List functions take a Q-Expression or vector
+#define LASSERT_SEQ(func, args, index)                                  \
+  LASSERT(args, LVAL_SEQ(args->cell[index]),                            \
+          "Function '%s' passed incorrect type. "                       \
+          "Got %s, Exptected %s or %s",                                 \
+          func, ltype_name(LTYPE(args->cell[index])),                   \
+          ltype_name(LVAL_QEXPR), ltype_name(LVAL_VECTOR));             \
+
+// Arguments of map and filter, a function and a Q-Expression or vector
+#define LASSERT_EACH(func, args)                                        \
+  LASSERT_NUM(func, args, 2);                                           \
+  LASSERT_TYPE(func, args, 0, LVAL_FUN);                                \
+  LASSERT_SEQ(func, args, 1);                                           \
+
 #define LASSERT_NOT_EMPTY(func, args, index)                    \
   LASSERT(args, args->cell[index]->count != 0,                  \
           "Function '%s' passed empty args!",                   \
@@ -54,6 +95,9 @@ void add_history(char* unused) {}
 #else
 #include <editline/readline.h>
 #include <histedit.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #endif
 
 mpc_parser_t* Number;
@@ -75,50 +119,158 @@ typedef struct lenv lenv;
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
 // Enum for lval possible values
-enum {LVAL_NUM, LVAL_ERR, LVAL_STRING, LVAL_BOOL, LVAL_SYM, LVAL_SEXPR, LVAL_QEXPR, LVAL_FUN };
-
-// Values structure
+enum {LVAL_NUM, LVAL_ERR, LVAL_STRING, LVAL_BOOL, LVAL_SYM, LVAL_SEXPR, LVAL_QEXPR, LVAL_FUN,
+      // Number out of long range, see lval_big
+      LVAL_BIG,
+      LVAL_DBL,
+      // Packed longs or doubles, see lval_vector
+      LVAL_VECTOR,
+      // Pending evaluation of body in env, never visible to lisp code
+      LVAL_TAIL };
+
+// Values structure. Numbers that fit in the pointer and booleans are
+// stored in the pointer itself (see LTYPE), everything else is allocated
+// and holds only the fields of its type.
 struct lval
 {
-  // Basic
   int type;
-  long num;
-  char* err;
-  char* sym;
-  char* str;
-  
+  // Number of owners sharing this value, it is freed when it drops to zero
+  int refs;
 
-  // Functions
-  lbuiltin builtin;
-  lenv* env;
-  // Symbols of the varibale ex. 'x=...'
-  lval* formals;
-  // Lines of code that will be executed in order when func is called
-  lval* body;
-  
-  // Expression
-  int count;
-  lval** cell;
+  union
+  {
+    // Number out of fixnum range
+    long num;
+    double dbl;
+
+    // Number out of long range, magnitude digits least significant first
+    struct
+    {
+      int neg;
+      int ndigits;
+      uint32_t* digits;
+    };
+
+    // Vector of len numbers stored side by side, doubles if is_dbl
+    struct
+    {
+      int len;
+      int is_dbl;
+      union
+      {
+        long* longs;
+        double* dbls;
+      };
+    };
+    char* err;
+    char* str;
+
+    // Symbol
+    struct
+    {
+      char* sym;
+      // Lookup hints, see lval_resolve and lenv_get
+      // Lexical address (frame depth and slot), depth is -1 if unresolved
+      int depth;
+      int slot;
+      // Global slot cached on first lookup, valid for one lenv_version
+      struct lentry* cache;
+      unsigned long version;
+    };
+
+    // Functions
+    struct
+    {
+      lbuiltin builtin;
+      lenv* env;
+      // Symbols of the varibale ex. 'x=...'
+      lval* formals;
+      // Lines of code that will be executed in order when func is called
+      lval* body;
+    };
+
+    // Expression, cell points start elements into array of cap elements
+    // so popping from the front needs no moving
+    struct
+    {
+      int count;
+      int cap;
+      int start;
+      lval** cell;
+      // Bytecode of the expression cached by the vm engine
+      struct lcode* code;
+    };
+  };
 };
 
+// Tags of immediate values, heap values are aligned so low bits are free
+#define LTAG_FIX 1
+#define LTAG_BOOL 2
+#define LTAG_MASK 3
+#define LFIX_MAX (INTPTR_MAX >> 2)
+#define LFIX_MIN (INTPTR_MIN >> 2)
+
+#define LVAL_IMM(v) ((uintptr_t) (v) & LTAG_MASK)
+#define LTYPE(v) (((uintptr_t) (v) & LTAG_FIX) ? LVAL_NUM                  \
+                  : ((uintptr_t) (v) & LTAG_BOOL) ? LVAL_BOOL : (v)->type)
+#define LNUM(v) (LVAL_IMM(v) ? (long) ((intptr_t) (v) >> 2) : (v)->num)
+// Numbers held in long, immediate or boxed
+#define LVAL_LONG(v) (LVAL_IMM(v) || (v)->type == LVAL_NUM)
+// Numbers of any type
+#define LVAL_NUMERIC(v) (LTYPE(v) == LVAL_NUM || LTYPE(v) == LVAL_BIG   \
+                         || LTYPE(v) == LVAL_DBL)
+// Lists that +, *, min and max given alone reduce
+#define LVAL_SEQ(v) (LTYPE(v) == LVAL_QEXPR || LTYPE(v) == LVAL_VECTOR)
+#define LSEQ_LEN(v) (LTYPE(v) == LVAL_VECTOR ? (v)->len : (v)->count)
+// Vector of doubles or a double, such operands make lvec_op work on doubles
+#define LVEC_DBL(v) (LTYPE(v) == LVAL_DBL                                \
+                     || (LTYPE(v) == LVAL_VECTOR && (v)->is_dbl))
+#define LVEC_BYTES(v) ((size_t) (v)->len                                \
+                       * ((v)->is_dbl ? sizeof(double) : sizeof(long)))
+// Compares numbers, negative if x < y, only long ones need no call
+#define LNUM_CMP(x, y) (LVAL_LONG(x) && LVAL_LONG(y)                    \
+                        ? (LNUM(x) > LNUM(y)) - (LNUM(x) < LNUM(y))     \
+                        : lbig_cmp(x, y))
+
+// Slot of the enviroment hash table, empty slots have NULL sym
+typedef struct lentry
+{
+  // Interned symbol name
+  char* sym;
+  lval* val;
+} lentry;
+
 struct lenv
 {
+  // Number of owners, function frames are kept alive by their callees
+  // and by pending tail calls
+  int refs;
   lenv* par;
+  // Number of used slots
   int count;
-  char** syms;
-  lval** vals;
+  // Open addressing table keyed by interned symbols, size is power of two
+  int size;
+  lentry* slots;
+  // Bit of each symbol bound here, see LENV_BIT
+  uint64_t mask;
+  // Set once a copied enviroment links to this one as its parent, so a
+  // value can reach the frame apart from the calls below it
+  int captured;
 };
 
 lval* builtin_add(lenv* e, lval* a);
+lval* builtin_alloc_stats(lenv* e, lval* a);
 lval* builtin_and(lenv* e, lval* a);
-lval* builtin_and_sym(lenv* e, lval* a);
-lval* builtin_cmp(lenv* e, lval* a, char* op);
 lval* builtin_cons(lenv* e, lval* a);
 lval* builtin_def(lenv* e, lval* a);
 lval* builtin_div(lenv* e, lval* a);
+lval* builtin_dot(lenv* e, lval* a);
+lval* builtin_drop(lenv* e, lval* a);
 lval* builtin_eq(lenv* e, lval* a);
 lval* builtin_error(lenv* e, lval* a);
 lval* builtin_eval(lenv* e, lval* a);
+lval* builtin_filter(lenv* e, lval* a);
+lval* builtin_gc_stats(lenv* e, lval* a);
 lval* builtin_ge(lenv* e, lval* a);
 lval* builtin_gt(lenv* e, lval* a);
 lval* builtin_head(lenv* e, lval* a);
@@ -126,106 +278,702 @@ lval* builtin_if(lenv* e, lval* a);
 lval* builtin_init(lenv* e, lval* a);
 lval* builtin_join(lenv* e, lval* a);
 lval* builtin_lambda(lenv* e, lval* a);
+lval* builtin_last(lenv* e, lval* a);
 lval* builtin_le(lenv* e, lval* a);
 lval* builtin_len(lenv* e, lval* a);
 lval* builtin_list(lenv* e, lval* a);
 lval* builtin_load(lenv* e, lval* a);
-lval* builtin_logic_op(lenv* e, lval* a, char* op);
 lval* builtin_lt(lenv* e, lval* a);
+lval* builtin_map(lenv* e, lval* a);
+lval* builtin_max(lenv* e, lval* a);
+lval* builtin_min(lenv* e, lval* a);
 lval* builtin_mul(lenv* e, lval* a);
 lval* builtin_ne(lenv* e, lval* a);
 lval* builtin_not(lenv* e, lval* a);
-lval* builtin_not_sym(lenv* e, lval* a);
+lval* builtin_nth(lenv* e, lval* a);
 lval* builtin_or(lenv* e, lval* a);
-lval* builtin_or_sym(lenv* e, lval* a);
-lval* builtin_ord(lenv* e, lval* a, char* op);
 lval* builtin_print(lenv* e, lval* a);
 lval* builtin_put(lenv* e, lval* a);
+lval* builtin_range(lenv* e, lval* a);
+lval* builtin_reverse(lenv* e, lval* a);
 lval* builtin_sub(lenv* e, lval* a);
+lval* builtin_sum(lenv* e, lval* a);
 lval* builtin_tail(lenv* e, lval* a);
+lval* builtin_take(lenv* e, lval* a);
 lval* builtin_var(lenv* e, lval* a, char* func);
+lval* builtin_vector(lenv* e, lval* a);
+lval* builtin_vector_list(lenv* e, lval* a);
+lval* builtin_vector_range(lenv* e, lval* a);
 
 
 int lval_eq(lval* x, lval* y);
-lval* lval_boolean(long x, char* s);
+lval* lval_boolean(long x);
 lval* lval_copy(lval* v);
 lval* lval_err(char *fmt, ...);
+lval* lval_apply(lenv* e, lval* v);
 lval* lval_eval(lenv* e, lval* v);
+lval* lval_eval_body(lenv* e, lval* q);
 lval* lval_eval_sexpr(lenv* e, lval* v);
+lval* lval_eval_tail(lenv* e, lval* v);
+lval* lval_force(lval* x);
+lval* lval_tail(lenv* e, lval* body);
 lval* lval_fun(lbuiltin func);
 lval* lval_join(lval* x, lval* y);
 lval* lval_lambda(lval* formals, lval* body);
 lval* lval_pop(lval* v, int i);
+lval* lval_dbl(double x);
+lval* lval_fold_big(lval* a, lval* x, lval* (*op)(lval*, lval*));
+lval* lval_fold_err(lval* a);
+lval* lval_fold_del(lval* a, int boxed, lval* x);
+lval* lval_fold_pick(lval* a, char* func, int max);
+lval* lval_reduce(lenv* e, lval* a, int op);
 lval* lval_read_str(mpc_ast_t* t);
 lval* lval_sym(char* s);
+lval* lval_sym_len(char* s, size_t n);
+lval* lval_str_len(char* s, size_t n);
 lval* lval_take(lval* v, int i);
+lval* lval_unshare(lval* v);
 void lval_del(lval* v);
 void lval_expr_print(lval* v, char open, char close);
 void lval_print(lval* v);
 void lval_print_str(lval* v);
+void lvec_print(lval* v);
+void lcode_del(struct lcode* c);
+lval* lbig_add(lval* x, lval* y);
+int lbig_cmp(lval* x, lval* y);
+lval* lbig_div(lval* x, lval* y);
+lval* lbig_mul(lval* x, lval* y);
+void lbig_print(lval* v);
+lval* lbig_read(char* s, size_t n, int neg);
+lval* lbig_sub(lval* x, lval* y);
+void ldbl_print(double x);
+lval* ldbl_read(char* s, size_t n);
+double lval_to_dbl(lval* v);
+lval* lreduce(lval* q, int op);
+lval* lval_vector(int len, int is_dbl);
+lval* lvec_op(lval* x, lval* y, int op);
+lval* lvec_reduce(lval* v, int op);
+void lgc_collect(void);
+void lgc_print_stats(void);
 
 lenv* lenv_copy(lenv* e);
+void lenv_del(lenv* e);
 void lenv_def(lenv* e, lval* k, lval* v);
 void lenv_put(lenv* e, lval* k, lval* v);
+void lenv_bind(lenv* e, lval* k, lval* v);
 char* ltype_name(int t);
+char* sym_intern(char* s);
+char* sym_intern_len(char* s, size_t n);
+
+// Execution engines selected by --engine
+enum { LENGINE_TREE, LENGINE_VM };
+int lval_engine = LENGINE_TREE;
+
+// Readers selected by --reader, mpc is kept for debugging the grammar
+enum { LREADER_NATIVE, LREADER_MPC };
+int lval_reader = LREADER_NATIVE;
+
+// Memory management selected by --gc. Copy frees values when their last
+// owner drops them, trace leaves them to the mark and sweep collector.
+enum { LGC_COPY, LGC_TRACE };
+int lgc_mode = LGC_COPY;
+
+// Element-wise operations of vectors, see lvec_op
+enum { LVEC_ADD, LVEC_SUB, LVEC_MUL, LVEC_DIV };
+
+
+// Interned symbol, lval sym points to the name
+typedef struct lsym
+{
+  // Number of enviroment entries binding this symbol
+  int binds;
+  char name[];
+} lsym;
+
+#define LSYM(s) ((lsym*) ((s) - offsetof(lsym, name)))
+
+// Interned symbol names, all symbols with the same name share one string
+// so they can be compared and hashed by pointer
+char** sym_table = NULL;
+int sym_table_size = 0;
+int sym_table_count = 0;
+
+unsigned long sym_hash_str(char* s, size_t n)
+{
+  // FNV-1a
+  unsigned long h = 2166136261u;
+  while (n--)
+    {
+      h ^= (unsigned char) *s++;
+      h *= 16777619u;
+    }
+  return h;
+}
+
+unsigned long sym_hash_ptr(char* s)
+{
+  // Interned names are unique so the address is a good key,
+  // low bits are always zero due to alignment
+  return ((unsigned long) s >> 4) * 11400714819323198485u;
+}
+
+// One of 64 bits picked by the top of the hash, the table uses the bottom.
+// A frame whose mask lacks the bit of a symbol doesn't bind it.
+#define LENV_BIT(sym)                                                   \
+  ((uint64_t) 1 << (sym_hash_ptr(sym) >> (sizeof(unsigned long) * 8 - 6)))
+
+char* sym_intern(char* s)
+{
+  return sym_intern_len(s, strlen(s));
+}
+
+// Interns first n characters of s, s needs no terminator
+char* sym_intern_len(char* s, size_t n)
+{
+  // Grow when table is half full
+  if (2 * (sym_table_count + 1) > sym_table_size)
+    {
+      int size = sym_table_size ? sym_table_size * 2 : 256;
+      char** table = calloc(size, sizeof(char*));
+      for (int i = 0; i < sym_table_size; i++)
+        {
+          if (!sym_table[i]) { continue; }
+          unsigned long j = sym_hash_str(sym_table[i], strlen(sym_table[i]))
+            & (size - 1);
+          while (table[j]) { j = (j + 1) & (size - 1); }
+          table[j] = sym_table[i];
+        }
+      free(sym_table);
+      sym_table = table;
+      sym_table_size = size;
+    }
+
+  unsigned long i = sym_hash_str(s, n) & (sym_table_size - 1);
+  while (sym_table[i])
+    {
+      if (strncmp(sym_table[i], s, n) == 0 && sym_table[i][n] == '\0')
+        {
+          return sym_table[i];
+        }
+      i = (i + 1) & (sym_table_size - 1);
+    }
+
+  lsym* y = malloc(sizeof(lsym) + n + 1);
+  y->binds = 0;
+  memcpy(y->name, s, n);
+  y->name[n] = '\0';
+  sym_table[i] = y->name;
+  sym_table_count++;
+  return sym_table[i];
+}
+
+void sym_table_del(void)
+{
+  for (int i = 0; i < sym_table_size; i++)
+    {
+      if (sym_table[i]) { free(LSYM(sym_table[i])); }
+    }
+  free(sym_table);
+  sym_table = NULL;
+  sym_table_size = 0;
+  sym_table_count = 0;
+}
+
+
+// Slab allocator for lvals, lenvs and their small arrays. Blocks are
+// carved from pages, every size class has its own free list.
+// In arena mode blocks allocated while evaluating a top level expression
+// are bumped from the arena page instead, and a page is recycled all at
+// once when nothing on it is used anymore.
+#define LALLOC_PAGE (64 * 1024)
+#define LALLOC_ALIGN 16
+#define LALLOC_CLASSES 16
+#define LALLOC_MAX (LALLOC_ALIGN * LALLOC_CLASSES)
+
+enum { LPAGE_SLAB, LPAGE_ARENA, LPAGE_GC };
+
+// Header at the start of every page
+typedef struct lpage
+{
+  int kind;
+  // Size class of slab page
+  int cls;
+  // Blocks and bytes in use
+  int live;
+  long used;
+  // Next free byte of arena page
+  char* bump;
+} lpage;
+
+#define LPAGE(p) ((lpage*) ((uintptr_t) (p) & ~(uintptr_t) (LALLOC_PAGE - 1)))
+#define LPAGE_HEADER ((sizeof(lpage) + LALLOC_ALIGN - 1) & ~(LALLOC_ALIGN - 1))
+
+typedef struct lblock
+{
+  struct lblock* next;
+} lblock;
+
+typedef struct lalloc_stats_t
+{
+  long allocs;
+  long frees;
+  // Bytes allocated since the last collection of --gc=trace
+  long bytes;
+  // Per size class
+  long slab_pages[LALLOC_CLASSES];
+  long slab_live[LALLOC_CLASSES];
+  long arena_pages;
+  long arena_live;
+  long arena_used;
+  long large_live;
+  long large_used;
+} lalloc_stats_t;
+
+// Enabled by --arena
+int lalloc_arena_mode = 0;
+
+// Evaluation is single threaded, but keep the state per thread so the
+// free lists never need locking
+_Thread_local lblock* lalloc_free[LALLOC_CLASSES];
+_Thread_local lpage* lalloc_arena = NULL;
+_Thread_local int lalloc_arena_depth = 0;
+_Thread_local lalloc_stats_t lalloc_stats;
+
+lpage* lpage_new(int kind)
+{
+  lpage* g = aligned_alloc(LALLOC_PAGE, LALLOC_PAGE);
+  g->kind = kind;
+  g->cls = 0;
+  g->live = 0;
+  g->used = 0;
+  g->bump = (char*) g + LPAGE_HEADER;
+  return g;
+}
+
+void lalloc_refill(int cls)
+{
+  size_t size = (cls + 1) * LALLOC_ALIGN;
+  lpage* g = lpage_new(LPAGE_SLAB);
+  g->cls = cls;
+  for (char* b = g->bump; b + size <= (char*) g + LALLOC_PAGE; b += size)
+    {
+      ((lblock*) b)->next = lalloc_free[cls];
+      lalloc_free[cls] = (lblock*) b;
+    }
+  lalloc_stats.slab_pages[cls]++;
+}
+
+void* lalloc(size_t n)
+{
+  if (n == 0) { return NULL; }
+  lalloc_stats.allocs++;
+  lalloc_stats.bytes += n;
+  if (n > LALLOC_MAX)
+    {
+      lalloc_stats.large_live++;
+      lalloc_stats.large_used += n;
+      return malloc(n);
+    }
+
+  size_t size = (n + LALLOC_ALIGN - 1) & ~(size_t) (LALLOC_ALIGN - 1);
+  if (lalloc_arena_mode && lalloc_arena_depth)
+    {
+      if (!lalloc_arena
+          || lalloc_arena->bump + size > (char*) lalloc_arena + LALLOC_PAGE)
+        {
+          // Full page is left to the blocks still living on it
+          if (lalloc_arena && lalloc_arena->live == 0)
+            {
+              free(lalloc_arena);
+              lalloc_stats.arena_pages--;
+            }
+          lalloc_arena = lpage_new(LPAGE_ARENA);
+          lalloc_stats.arena_pages++;
+        }
+      void* b = lalloc_arena->bump;
+      lalloc_arena->bump += size;
+      lalloc_arena->live++;
+      lalloc_arena->used += size;
+      lalloc_stats.arena_live++;
+      lalloc_stats.arena_used += size;
+      return b;
+    }
+
+  int cls = size / LALLOC_ALIGN - 1;
+  if (!lalloc_free[cls]) { lalloc_refill(cls); }
+  lblock* b = lalloc_free[cls];
+  lalloc_free[cls] = b->next;
+  LPAGE(b)->live++;
+  lalloc_stats.slab_live[cls]++;
+  return b;
+}
+
+void lfree(void* p, size_t n)
+{
+  if (!p) { return; }
+  lalloc_stats.frees++;
+  if (n > LALLOC_MAX)
+    {
+      lalloc_stats.large_live--;
+      lalloc_stats.large_used -= n;
+      free(p);
+      return;
+    }
+
+  size_t size = (n + LALLOC_ALIGN - 1) & ~(size_t) (LALLOC_ALIGN - 1);
+  lpage* g = LPAGE(p);
+  g->live--;
+  if (g->kind == LPAGE_ARENA)
+    {
+      g->used -= size;
+      lalloc_stats.arena_live--;
+      lalloc_stats.arena_used -= size;
+      if (g->live == 0 && g != lalloc_arena)
+        {
+          free(g);
+          lalloc_stats.arena_pages--;
+        }
+      return;
+    }
+
+  ((lblock*) p)->next = lalloc_free[g->cls];
+  lalloc_free[g->cls] = p;
+  lalloc_stats.slab_live[g->cls]--;
+}
+
+void* lrealloc(void* p, size_t old, size_t n)
+{
+  size_t old_size = (old + LALLOC_ALIGN - 1) & ~(size_t) (LALLOC_ALIGN - 1);
+  size_t size = (n + LALLOC_ALIGN - 1) & ~(size_t) (LALLOC_ALIGN - 1);
+  // Block of the same size class already fits
+  if (p && n && old <= LALLOC_MAX && n <= LALLOC_MAX && old_size == size)
+    {
+      return p;
+    }
+  void* q = lalloc(n);
+  if (p && q) { memcpy(q, p, old < n ? old : n); }
+  lfree(p, old);
+  return q;
+}
+
+void lalloc_arena_begin(void)
+{
+  lalloc_arena_depth++;
+}
+
+// End of top level expression, if it left nothing behind on the arena
+// page it is reused from the start, otherwise the page is retired and
+// freed when its last block is
+void lalloc_arena_end(void)
+{
+  if (--lalloc_arena_depth > 0 || !lalloc_arena) { return; }
+  if (lalloc_arena->live == 0)
+    {
+      lalloc_arena->bump = (char*) lalloc_arena + LPAGE_HEADER;
+      lalloc_arena->used = 0;
+    }
+  else
+    {
+      lalloc_arena = NULL;
+    }
+}
+
+void lalloc_print_stats(void)
+{
+  long held = 0;
+  long used = 0;
+  printf("%6s %10s %10s %8s\n", "size", "live", "free", "pages");
+  for (int c = 0; c < LALLOC_CLASSES; c++)
+    {
+      if (!lalloc_stats.slab_pages[c]) { continue; }
+      long size = (c + 1) * LALLOC_ALIGN;
+      long blocks = lalloc_stats.slab_pages[c]
+        * ((LALLOC_PAGE - LPAGE_HEADER) / size);
+      printf("%6li %10li %10li %8li\n", size, lalloc_stats.slab_live[c],
+             blocks - lalloc_stats.slab_live[c], lalloc_stats.slab_pages[c]);
+      held += lalloc_stats.slab_pages[c] * LALLOC_PAGE;
+      used += lalloc_stats.slab_live[c] * size;
+    }
+  printf("%6s %10li %10s %8li\n", "arena", lalloc_stats.arena_live, "-",
+         lalloc_stats.arena_pages);
+  printf("%6s %10li\n", "large", lalloc_stats.large_live);
+  held += lalloc_stats.arena_pages * LALLOC_PAGE + lalloc_stats.large_used;
+  used += lalloc_stats.arena_used + lalloc_stats.large_used;
+  printf("allocs %li, frees %li\n", lalloc_stats.allocs, lalloc_stats.frees);
+  printf("held %li bytes, used %li bytes, fragmentation %.1f%%\n",
+         held, used, held ? 100.0 * (held - used) / held : 0.0);
+}
+
+// Pages of the tracing collector hold only lvals or only lenvs, so any
+// word pointing into them can be mapped back to the object. Bitmaps tell
+// which blocks are allocated and which were reached while marking.
+#define LGC_BITMAP (LALLOC_PAGE / 32 / 8)
+
+enum { LGC_LVAL, LGC_LENV };
+
+typedef struct lgc_page
+{
+  lpage page;
+  // LGC_LVAL or LGC_LENV
+  int type;
+  int size;
+  int blocks;
+  unsigned char alloc[LGC_BITMAP];
+  unsigned char mark[LGC_BITMAP];
+} lgc_page;
+
+#define LGC_HEADER ((sizeof(lgc_page) + LALLOC_ALIGN - 1) & ~(LALLOC_ALIGN - 1))
+#define LGC_BLOCK(g, i) ((char*) (g) + LGC_HEADER + (size_t) (i) * (g)->size)
+#define LGC_BIT(map, i) ((map)[(i) >> 3] & (1 << ((i) & 7)))
+
+// Collection starts once this many bytes were allocated since the last
+// one, or as many as survived it if that is more
+#define LGC_MIN_HEAP (1024 * 1024)
+
+typedef struct lgc_stats_t
+{
+  long collections;
+  // Bytes allocated since the last collection
+  long allocated;
+  // Objects per type
+  long live[2];
+  long freed[2];
+  long pages;
+  // Seconds spent collecting
+  double total;
+  double pause;
+} lgc_stats_t;
+
+// Pages sorted by address
+lgc_page** lgc_pages = NULL;
+int lgc_pages_count = 0;
+long lgc_threshold = LGC_MIN_HEAP;
+lgc_stats_t lgc_stats;
+lblock* lgc_free[2];
+
+void lgc_refill(int type, size_t n)
+{
+  lgc_page* g = (lgc_page*) lpage_new(LPAGE_GC);
+  g->type = type;
+  g->size = (n + LALLOC_ALIGN - 1) & ~(size_t) (LALLOC_ALIGN - 1);
+  g->blocks = (LALLOC_PAGE - LGC_HEADER) / g->size;
+  memset(g->alloc, 0, LGC_BITMAP);
+  memset(g->mark, 0, LGC_BITMAP);
+  for (int i = g->blocks - 1; i >= 0; i--)
+    {
+      ((lblock*) LGC_BLOCK(g, i))->next = lgc_free[type];
+      lgc_free[type] = (lblock*) LGC_BLOCK(g, i);
+    }
+
+  int i = lgc_pages_count++;
+  lgc_pages = realloc(lgc_pages, sizeof(lgc_page*) * lgc_pages_count);
+  for (; i > 0 && lgc_pages[i - 1] > g; i--) { lgc_pages[i] = lgc_pages[i - 1]; }
+  lgc_pages[i] = g;
+  lgc_stats.pages++;
+}
+
+// Allocate lval or lenv. Objects of the tracing collector are zeroed, so
+// a collection started by the next allocation never sees garbage fields
+// of one still being built.
+void* lgc_alloc(int type, size_t n)
+{
+  if (lgc_mode != LGC_TRACE) { return lalloc(n); }
+  lalloc_stats.allocs++;
+
+  // Arrays of the objects count as well
+  if (lgc_stats.allocated + lalloc_stats.bytes >= lgc_threshold)
+    {
+      lgc_collect();
+    }
+  if (!lgc_free[type]) { lgc_refill(type, n); }
+  lblock* b = lgc_free[type];
+  lgc_free[type] = b->next;
+
+  lgc_page* g = (lgc_page*) LPAGE(b);
+  int i = ((char*) b - LGC_BLOCK(g, 0)) / g->size;
+  g->alloc[i >> 3] |= 1 << (i & 7);
+  memset(b, 0, g->size);
+  lgc_stats.allocated += g->size;
+  lgc_stats.live[type]++;
+  return b;
+}
 
+// Bumped whenever cached global slots may become stale
+unsigned long lenv_version = 0;
 
 lenv* lenv_new(void)
 {
-  lenv* e = malloc(sizeof(lenv));
+  lenv* e = lgc_alloc(LGC_LENV, sizeof(lenv));
+  e->refs = 1;
   e->par = NULL;
   e->count = 0;
-  e->syms = NULL;
-  e->vals = NULL;
+  e->size = 0;
+  e->slots = NULL;
+  e->mask = 0;
+  e->captured = 0;
+  return e;
+}
+
+// Enviroment of function call, sized so binding n arguments
+// never grows the table and each formal always lands in the same slot
+lenv* lenv_new_frame(int n)
+{
+  lenv* e = lenv_new();
+  e->size = 8;
+  while (e->size < 2 * (n + 1)) { e->size *= 2; }
+  e->slots = lalloc(sizeof(lentry) * e->size);
+  memset(e->slots, 0, sizeof(lentry) * e->size);
   return e;
 }
 
 void lenv_del(lenv* e)
 {
-  for (int i = 0; i < e->count; i++) {
-    free(e->syms[i]);
-    lval_del(e->vals[i]);
-  }
-  free(e->syms);
-  free(e->vals);
-  free(e);
+  // Traced enviroments are freed by the collector only
+  if (lgc_mode == LGC_TRACE || --e->refs > 0) { return; }
+
+  for (int i = 0; i < e->size; i++)
+    {
+      if (e->slots[i].sym)
+        {
+          LSYM(e->slots[i].sym)->binds--;
+          lval_del(e->slots[i].val);
+        }
+    }
+  lfree(e->slots, sizeof(lentry) * e->size);
+  if (e->par) { lenv_del(e->par); }
+  lfree(e, sizeof(lenv));
+}
+
+void lenv_set_par(lenv* e, lenv* par)
+{
+  if (par) { par->refs++; }
+  if (e->par) { lenv_del(e->par); }
+  e->par = par;
+}
+
+// Returns slot of the interned symbol, or empty slot where it belongs
+lentry* lenv_slot(lenv* e, char* sym)
+{
+  unsigned long i = sym_hash_ptr(sym) & (e->size - 1);
+  while (e->slots[i].sym && e->slots[i].sym != sym)
+    {
+      i = (i + 1) & (e->size - 1);
+    }
+  return &e->slots[i];
+}
+
+// Whether e binds every symbol bound in p
+int lenv_covers(lenv* e, lenv* p)
+{
+  if (p->count == 0) { return 1; }
+  if (p->count > e->count || (p->mask & ~e->mask)) { return 0; }
+  for (int i = 0; i < p->size; i++)
+    {
+      if (p->slots[i].sym && !lenv_slot(e, p->slots[i].sym)->sym)
+        {
+          return 0;
+        }
+    }
+  return 1;
 }
 
 lval* lenv_get(lenv* e, lval* k)
 {
-  // Iterate all over the items in enviroment
-  for (int i = 0; i < e->count; i++)
+  // Lexical address is only a hint as scoping is dynamic, it holds
+  // when no nearer frame binds the symbol and the slot still has it.
+  // The masks tell that without probing the nearer frames.
+  if (k->depth >= 0)
     {
-    if (strcmp(e->syms[i], k->sym) == 0)
-      {
-        return lval_copy(e->vals[i]);
-      }
+      lenv* f = e;
+      int d = 0;
+      uint64_t bit = k->depth ? LENV_BIT(k->sym) : 0;
+      for (; f && d < k->depth; f = f->par, d++)
+        {
+          if ((f->mask & bit) && lenv_slot(f, k->sym)->sym) { break; }
+        }
+      if (f && d == k->depth && k->slot < f->size
+          && f->slots[k->slot].sym == k->sym)
+        {
+          return lval_copy(f->slots[k->slot].val);
+        }
+    }
+
+  // Cached global holds while nothing else binds the symbol
+  if (k->cache && k->version == lenv_version && LSYM(k->sym)->binds == 1)
+    {
+      return lval_copy(k->cache->val);
     }
-  // Look for symbol in parent environment
-  if (e->par)
+
+  // Look for symbol in this and then parent environments
+  uint64_t bit = LENV_BIT(k->sym);
+  for (; e; e = e->par)
     {
-      return lenv_get(e->par, k);
+      if (!(e->mask & bit)) { continue; }
+      lentry* s = lenv_slot(e, k->sym);
+      if (s->sym)
+        {
+          // Only the global enviroment has no parent during lookup
+          if (!e->par)
+            {
+              k->cache = s;
+              k->version = lenv_version;
+            }
+          return lval_copy(s->val);
+        }
     }
   // No symbol found, return error
   return lval_err("Unbound Symbol '%s'!", k->sym);
 }
 
+// Values are shared with the original enviroment, only the table is new
 lenv* lenv_copy(lenv* e)
 {
-  lenv* n = malloc(sizeof(lenv));
+  lenv* n = lgc_alloc(LGC_LENV, sizeof(lenv));
+  n->refs = 1;
   n->par = e->par;
+  if (n->par)
+    {
+      n->par->refs++;
+      n->par->captured = 1;
+    }
   n->count = e->count;
-  n->syms = malloc(sizeof(char*) * n->count);
-  n->vals = malloc(sizeof(lval*) * n->count);
-  for (int i = 0; i < e->count; i++)
+  n->size = e->size;
+  n->mask = e->mask;
+  n->captured = 0;
+  n->slots = NULL;
+  if (n->size)
+    {
+      n->slots = lalloc(sizeof(lentry) * n->size);
+      memcpy(n->slots, e->slots, sizeof(lentry) * n->size);
+    }
+  for (int i = 0; i < n->size; i++)
     {
-      n->syms[i] = malloc(strlen(e->syms[i])+1);
-      strcpy(n->syms[i], e->syms[i]);
-      n->vals[i] = lval_copy(e->vals[i]);
+      if (n->slots[i].sym)
+        {
+          LSYM(n->slots[i].sym)->binds++;
+          lval_copy(n->slots[i].val);
+        }
     }
   return n;
 }
 
+void lenv_grow(lenv* e)
+{
+  // Slots move, drop cached ones
+  lenv_version++;
+  int size = e->size ? e->size * 2 : 8;
+  lentry* old = e->slots;
+  int old_size = e->size;
+  e->slots = lalloc(sizeof(lentry) * size);
+  memset(e->slots, 0, sizeof(lentry) * size);
+  e->size = size;
+  for (int i = 0; i < old_size; i++)
+    {
+      if (old[i].sym) { *lenv_slot(e, old[i].sym) = old[i]; }
+    }
+  lfree(old, sizeof(lentry) * old_size);
+}
+
 void lenv_def(lenv* e, lval* k, lval* v)
 {
   // Iterate till the e has no parent
@@ -233,6 +981,7 @@ void lenv_def(lenv* e, lval* k, lval* v)
     {
       e = e->par;
     }
+  lenv_version++;
   lenv_put(e, k, v);
 }
 
@@ -240,28 +989,51 @@ void lenv_put(lenv* e, lval* k, lval* v)
 {
   // k - Variable symbol
   // v - what is this variable
-  // iterate over all items in the enviroment
-  // to see whereas variable already exists
-  for (int i = 0; i < e->count; i++)
+  // Keep the table at most half full
+  if (2 * (e->count + 1) > e->size) { lenv_grow(e); }
+
+  lentry* s = lenv_slot(e, k->sym);
+  // if found delete it and replace with new
+  if (s->sym)
     {
-    // if found delete it and replace with new
-    if (strcmp(e->syms[i], k->sym) == 0)
-      {
-        lval_del(e->vals[i]);
-        e->vals[i] = lval_copy(v);
-        return;
-      }
+      lval_del(s->val);
+      s->val = lval_copy(v);
+      return;
     }
 
-  // If no entry, allocate mem for a new one
+  // If no entry, take the empty slot
   e->count++;
-  e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-  e->syms = realloc(e->syms, sizeof(char*) * e->count);
+  e->mask |= LENV_BIT(k->sym);
+  LSYM(k->sym)->binds++;
+  s->sym = k->sym;
+  s->val = lval_copy(v);
+}
 
-  // Now copy val and its new symbol to allocated space
-  e->vals[e->count-1] = lval_copy(v);
-  e->syms[e->count-1] = malloc(strlen(k->sym)+1);
-  strcpy(e->syms[e->count-1], k->sym);
+// Binds formal k of a lambda in its frame e. builtin_lambda resolves the
+// formals to the slots they take in a frame filled in their order, which
+// is how lval_call fills it, so they are stored by index without probing.
+void lenv_bind(lenv* e, lval* k, lval* v)
+{
+  if (k->depth == 0 && k->slot < e->size)
+    {
+      lentry* s = &e->slots[k->slot];
+      if (s->sym == k->sym)
+        {
+          lval_del(s->val);
+          s->val = lval_copy(v);
+          return;
+        }
+      if (!s->sym)
+        {
+          e->count++;
+          e->mask |= LENV_BIT(k->sym);
+          LSYM(k->sym)->binds++;
+          s->sym = k->sym;
+          s->val = lval_copy(v);
+          return;
+        }
+    }
+  lenv_put(e, k, v);
 }
 
 void lenv_add_builtin(lenv* e, char* name, lbuiltin func)
@@ -281,11 +1053,24 @@ void lenv_add_builtins(lenv* e)
     lenv_add_builtin(e, "tail", builtin_tail);
     lenv_add_builtin(e, "eval", builtin_eval);
     lenv_add_builtin(e, "join", builtin_join);
+    lenv_add_builtin(e, "len", builtin_len);
+    lenv_add_builtin(e, "nth", builtin_nth);
+    lenv_add_builtin(e, "last", builtin_last);
+    lenv_add_builtin(e, "take", builtin_take);
+    lenv_add_builtin(e, "drop", builtin_drop);
+    lenv_add_builtin(e, "init", builtin_init);
+    lenv_add_builtin(e, "cons", builtin_cons);
+    lenv_add_builtin(e, "reverse", builtin_reverse);
+    lenv_add_builtin(e, "range", builtin_range);
 
     // String funcs
     lenv_add_builtin(e, "load", builtin_load);
     lenv_add_builtin(e, "error", builtin_error);
     lenv_add_builtin(e, "print", builtin_print);
+
+    // Interpreter internals
+    lenv_add_builtin(e, "alloc-stats", builtin_alloc_stats);
+    lenv_add_builtin(e, "gc-stats", builtin_gc_stats);
     
     // Add variables
     lenv_add_builtin(e, "def", builtin_def);
@@ -303,76 +1088,1319 @@ void lenv_add_builtins(lenv* e)
 
     // Logic functions
     lenv_add_builtin(e, "or", builtin_or);
-    lenv_add_builtin(e, "||", builtin_or_sym);
-    lenv_add_builtin(e, "not", builtin_not_sym);
+    lenv_add_builtin(e, "||", builtin_or);
+    lenv_add_builtin(e, "not", builtin_not);
     lenv_add_builtin(e, "!", builtin_not);
     lenv_add_builtin(e, "and", builtin_and);
-    lenv_add_builtin(e, "&&", builtin_and_sym);
+    lenv_add_builtin(e, "&&", builtin_and);
     
     // Mathematical funcions
     lenv_add_builtin(e, "+", builtin_add);
     lenv_add_builtin(e, "-", builtin_sub);
     lenv_add_builtin(e, "*", builtin_mul);
     lenv_add_builtin(e, "/", builtin_div);
+    lenv_add_builtin(e, "min", builtin_min);
+    lenv_add_builtin(e, "max", builtin_max);
+    lenv_add_builtin(e, "sum", builtin_sum);
+
+    // Vector functions
+    lenv_add_builtin(e, "vector", builtin_vector);
+    lenv_add_builtin(e, "vector-range", builtin_vector_range);
+    lenv_add_builtin(e, "vector-list", builtin_vector_list);
+    lenv_add_builtin(e, "dot", builtin_dot);
+    lenv_add_builtin(e, "map", builtin_map);
+    lenv_add_builtin(e, "filter", builtin_filter);
 }
     
 
 // CONTRUCT a pointer to a new Number lval
 lval* lval_num(long x)
 {
-  lval* v = malloc(sizeof(lval));
+  // Small numbers need no allocation
+  if (x >= LFIX_MIN && x <= LFIX_MAX)
+    {
+      return (lval*) (((uintptr_t) x << 2) | LTAG_FIX);
+    }
+  lval* v = lgc_alloc(LGC_LVAL, sizeof(lval));
   v->type = LVAL_NUM;
+  v->refs = 1;
   v->num = x;
   return v;
 }
 
-// Function makes default user function
-// Formals are arugments of this function and body is body of it
-lval* lval_lambda(lval* formals, lval* body)
+// Overflow checked arithmetic on long, true if the result does not fit
+#ifdef __GNUC__
+#define LADD_OVERFLOW(a, b, r) __builtin_add_overflow(a, b, r)
+#define LSUB_OVERFLOW(a, b, r) __builtin_sub_overflow(a, b, r)
+#define LMUL_OVERFLOW(a, b, r) __builtin_mul_overflow(a, b, r)
+#else
+int ladd_overflow(long a, long b, long* r)
 {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_FUN;
+  if (b > 0 ? a > LONG_MAX - b : a < LONG_MIN - b) { return 1; }
+  *r = a + b;
+  return 0;
+}
 
-  // Set builtin to null
-  v->builtin = NULL;
-  // Build new enviroment
-  v->env = lenv_new();
-  // Set formals and body
-  v->formals = formals;
-  v->body = body;
-  return v;
+int lsub_overflow(long a, long b, long* r)
+{
+  if (b < 0 ? a > LONG_MAX + b : a < LONG_MIN + b) { return 1; }
+  *r = a - b;
+  return 0;
 }
 
-lval* lval_boolean(long x, char* s)
+int lmul_overflow(long a, long b, long* r)
 {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_BOOL;
-  v->num = x;
-  v->sym = malloc(strlen(s) + 1);
-  strcpy(v->sym, s);
-  return v;
+  if (a && b && (a == -1 ? b == LONG_MIN : b == -1 ? a == LONG_MIN
+                 : (a > 0) == (b > 0) ? a > LONG_MAX / b : a < LONG_MIN / b))
+    {
+      return 1;
+    }
+  *r = a * b;
+  return 0;
 }
- 
-// make a new func
-lval* lval_fun(lbuiltin func)
+#define LADD_OVERFLOW(a, b, r) ladd_overflow(a, b, r)
+#define LSUB_OVERFLOW(a, b, r) lsub_overflow(a, b, r)
+#define LMUL_OVERFLOW(a, b, r) lmul_overflow(a, b, r)
+#endif
+
+// Big numbers. Only values out of long range are big, arithmetic works on
+// their magnitudes in base 2^32 digits with the least significant first.
+// Products of operands of at least LBIG_KARATSUBA digits use Karatsuba.
+#define LBIG_KARATSUBA 32
+
+// Number of magnitude d of n digits, takes over d. Results that fit in
+// long become plain numbers again.
+lval* lval_big(int neg, uint32_t* d, int n)
 {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_FUN;
-  v->builtin = func;
+  while (n > 0 && d[n - 1] == 0) { n--; }
+  if (n <= 2)
+    {
+      unsigned long long m = n ? d[0] : 0;
+      if (n == 2) { m |= (unsigned long long) d[1] << 32; }
+      if (m <= LONG_MAX || (neg && m == (unsigned long long) LONG_MAX + 1))
+        {
+          free(d);
+          return lval_num(neg ? -(long) (m - 1) - 1 : (long) m);
+        }
+    }
+  lval* v = lgc_alloc(LGC_LVAL, sizeof(lval));
+  v->type = LVAL_BIG;
+  v->refs = 1;
+  v->neg = neg;
+  v->ndigits = n;
+  v->digits = d;
   return v;
 }
 
-// Construct a pointer to a new error type lval
-lval* lval_err(char* fmt, ...)
+// Magnitude of number v, digits of small numbers are written to buf
+int lbig_digits(lval* v, uint32_t* buf, uint32_t** d, int* neg)
 {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_ERR;
+  if (LTYPE(v) == LVAL_BIG)
+    {
+      *neg = v->neg;
+      *d = v->digits;
+      return v->ndigits;
+    }
+  long x = LNUM(v);
+  unsigned long long m = x < 0 ? 0 - (unsigned long long) x : (unsigned long long) x;
+  *neg = x < 0;
+  *d = buf;
+  buf[0] = (uint32_t) m;
+  buf[1] = (uint32_t) (m >> 32);
+  return buf[1] ? 2 : buf[0] ? 1 : 0;
+}
 
-  // Create a va list and init it
-  va_list va;
-  va_start(va, fmt);
-  // Alloc buffer
-  v->err = malloc(512);
+int lbig_cmp_mag(uint32_t* a, int na, uint32_t* b, int nb)
+{
+  if (na != nb) { return na < nb ? -1 : 1; }
+  for (int i = na - 1; i >= 0; i--)
+    {
+      if (a[i] != b[i]) { return a[i] < b[i] ? -1 : 1; }
+    }
+  return 0;
+}
+
+// r[0..n) += a[0..na), the carry must fit in r
+void lbig_add_into(uint32_t* r, int n, uint32_t* a, int na)
+{
+  uint64_t carry = 0;
+  int i = 0;
+  for (; i < na; i++)
+    {
+      carry += (uint64_t) r[i] + a[i];
+      r[i] = (uint32_t) carry;
+      carry >>= 32;
+    }
+  for (; carry && i < n; i++)
+    {
+      carry += r[i];
+      r[i] = (uint32_t) carry;
+      carry >>= 32;
+    }
+}
+
+// r[0..n) -= a[0..na), r must not be smaller than a
+void lbig_sub_into(uint32_t* r, int n, uint32_t* a, int na)
+{
+  int64_t borrow = 0;
+  int i = 0;
+  for (; i < na; i++)
+    {
+      borrow += (int64_t) r[i] - a[i];
+      r[i] = (uint32_t) borrow;
+      borrow = borrow < 0 ? -1 : 0;
+    }
+  for (; borrow && i < n; i++)
+    {
+      borrow += r[i];
+      r[i] = (uint32_t) borrow;
+      borrow = borrow < 0 ? -1 : 0;
+    }
+}
+
+// r[0..na+nb) += a * b
+void lbig_mul_mag(uint32_t* r, uint32_t* a, int na, uint32_t* b, int nb)
+{
+  if (na < nb)
+    {
+      uint32_t* t = a; a = b; b = t;
+      int n = na; na = nb; nb = n;
+    }
+  if (nb == 0) { return; }
+
+  if (nb < LBIG_KARATSUBA)
+    {
+      for (int j = 0; j < nb; j++)
+        {
+          uint64_t carry = 0;
+          for (int i = 0; i < na; i++)
+            {
+              carry += (uint64_t) a[i] * b[j] + r[i + j];
+              r[i + j] = (uint32_t) carry;
+              carry >>= 32;
+            }
+          uint32_t top = (uint32_t) carry;
+          lbig_add_into(r + j + na, nb - j, &top, 1);
+        }
+      return;
+    }
+
+  if (na >= 2 * nb)
+    {
+      // Unbalanced, multiply by pieces of a as long as b
+      for (int i = 0; i < na; i += nb)
+        {
+          int n = na - i < nb ? na - i : nb;
+          lbig_mul_mag(r + i, a + i, n, b, nb);
+        }
+      return;
+    }
+
+  // a = a1 B^m + a0 and b = b1 B^m + b0, the middle term comes from
+  // (a0 + a1)(b0 + b1) - a0 b0 - a1 b1
+  int m = nb / 2;
+  int n = na + nb;
+  uint32_t* z = calloc(n, sizeof(uint32_t));
+  lbig_mul_mag(z, a, m, b, m);
+  lbig_mul_mag(z + 2 * m, a + m, na - m, b + m, nb - m);
+
+  int nsa = na - m + 1;
+  int nsb = (nb - m > m ? nb - m : m) + 1;
+  uint32_t* sa = calloc(nsa + nsb, sizeof(uint32_t));
+  uint32_t* sb = sa + nsa;
+  memcpy(sa, a + m, sizeof(uint32_t) * (na - m));
+  lbig_add_into(sa, nsa, a, m);
+  memcpy(sb, b + m, sizeof(uint32_t) * (nb - m));
+  lbig_add_into(sb, nsb, b, m);
+
+  uint32_t* mid = calloc(nsa + nsb, sizeof(uint32_t));
+  lbig_mul_mag(mid, sa, nsa, sb, nsb);
+  lbig_sub_into(mid, nsa + nsb, z, 2 * m);
+  lbig_sub_into(mid, nsa + nsb, z + 2 * m, n - 2 * m);
+
+  int nmid = nsa + nsb;
+  while (nmid > 0 && mid[nmid - 1] == 0) { nmid--; }
+  lbig_add_into(z + m, n - m, mid, nmid);
+  lbig_add_into(r, n, z, n);
+
+  free(mid);
+  free(sa);
+  free(z);
+}
+
+// q[0..m-n] = u / v with v[n-1] not zero and m >= n, Knuth's algorithm D
+void lbig_div_mag(uint32_t* q, uint32_t* u, int m, uint32_t* v, int n)
+{
+  if (n == 1)
+    {
+      uint64_t rem = 0;
+      for (int j = m - 1; j >= 0; j--)
+        {
+          uint64_t t = (rem << 32) | u[j];
+          q[j] = (uint32_t) (t / v[0]);
+          rem = t % v[0];
+        }
+      return;
+    }
+
+  // Normalize so the top digit of the divisor has its high bit set
+  int s = 0;
+  while (!((v[n - 1] << s) & 0x80000000u)) { s++; }
+  uint32_t* vn = malloc(sizeof(uint32_t) * (n + m + 1));
+  uint32_t* un = vn + n;
+  for (int i = n - 1; i > 0; i--)
+    {
+      vn[i] = (v[i] << s) | (uint32_t) ((uint64_t) v[i - 1] >> (32 - s));
+    }
+  vn[0] = v[0] << s;
+  un[m] = (uint32_t) ((uint64_t) u[m - 1] >> (32 - s));
+  for (int i = m - 1; i > 0; i--)
+    {
+      un[i] = (u[i] << s) | (uint32_t) ((uint64_t) u[i - 1] >> (32 - s));
+    }
+  un[0] = u[0] << s;
+
+  for (int j = m - n; j >= 0; j--)
+    {
+      // Estimate the quotient digit from the top two digits, it is at
+      // most two too large
+      uint64_t num = ((uint64_t) un[j + n] << 32) | un[j + n - 1];
+      uint64_t qhat = num / vn[n - 1];
+      uint64_t rhat = num % vn[n - 1];
+      while (qhat >> 32
+             || qhat * vn[n - 2] > ((rhat << 32) | un[j + n - 2]))
+        {
+          qhat--;
+          rhat += vn[n - 1];
+          if (rhat >> 32) { break; }
+        }
+
+      // Multiply and subtract
+      int64_t borrow = 0;
+      int64_t t;
+      for (int i = 0; i < n; i++)
+        {
+          uint64_t p = qhat * vn[i];
+          t = un[i + j] - borrow - (int64_t) (p & 0xffffffffu);
+          un[i + j] = (uint32_t) t;
+          borrow = (int64_t) (p >> 32) - (t >> 32);
+        }
+      t = un[j + n] - borrow;
+      un[j + n] = (uint32_t) t;
+
+      // Add back if it was one too large
+      q[j] = (uint32_t) qhat;
+      if (t < 0)
+        {
+          q[j]--;
+          uint64_t carry = 0;
+          for (int i = 0; i < n; i++)
+            {
+              carry += (uint64_t) un[i + j] + vn[i];
+              un[i + j] = (uint32_t) carry;
+              carry >>= 32;
+            }
+          un[j + n] += (uint32_t) carry;
+        }
+    }
+  free(vn);
+}
+
+// Arithmetic on numbers of any size. Takes over x, y is borrowed.
+// Doubles are contagious, an operation with one gives a double.
+// Vectors are more so, any operation with one is element-wise.
+lval* lbig_add_sign(lval* x, lval* y, int flip)
+{
+  if (LTYPE(x) == LVAL_VECTOR || LTYPE(y) == LVAL_VECTOR)
+    {
+      return lvec_op(x, y, flip ? LVEC_SUB : LVEC_ADD);
+    }
+  if (LTYPE(x) == LVAL_DBL || LTYPE(y) == LVAL_DBL)
+    {
+      double d = flip ? -lval_to_dbl(y) : lval_to_dbl(y);
+      lval* v = lval_dbl(lval_to_dbl(x) + d);
+      lval_del(x);
+      return v;
+    }
+  uint32_t xb[2], yb[2];
+  uint32_t* xd;
+  uint32_t* yd;
+  int xneg, yneg;
+  int xn = lbig_digits(x, xb, &xd, &xneg);
+  int yn = lbig_digits(y, yb, &yd, &yneg);
+  yneg ^= flip;
+
+  // Work on the larger magnitude, the result takes its sign unless
+  // the signs are equal
+  if (lbig_cmp_mag(xd, xn, yd, yn) < 0)
+    {
+      uint32_t* t = xd; xd = yd; yd = t;
+      int n = xn; xn = yn; yn = n;
+      n = xneg; xneg = yneg; yneg = n;
+    }
+  uint32_t* r = calloc(xn + 1, sizeof(uint32_t));
+  memcpy(r, xd, sizeof(uint32_t) * xn);
+  if (xneg == yneg) { lbig_add_into(r, xn + 1, yd, yn); }
+  else { lbig_sub_into(r, xn, yd, yn); }
+
+  lval* v = lval_big(xneg, r, xn + 1);
+  lval_del(x);
+  return v;
+}
+
+lval* lbig_add(lval* x, lval* y)
+{
+  return lbig_add_sign(x, y, 0);
+}
+
+lval* lbig_sub(lval* x, lval* y)
+{
+  return lbig_add_sign(x, y, 1);
+}
+
+lval* lbig_mul(lval* x, lval* y)
+{
+  if (LTYPE(x) == LVAL_VECTOR || LTYPE(y) == LVAL_VECTOR)
+    {
+      return lvec_op(x, y, LVEC_MUL);
+    }
+  if (LTYPE(x) == LVAL_DBL || LTYPE(y) == LVAL_DBL)
+    {
+      lval* v = lval_dbl(lval_to_dbl(x) * lval_to_dbl(y));
+      lval_del(x);
+      return v;
+    }
+  uint32_t xb[2], yb[2];
+  uint32_t* xd;
+  uint32_t* yd;
+  int xneg, yneg;
+  int xn = lbig_digits(x, xb, &xd, &xneg);
+  int yn = lbig_digits(y, yb, &yd, &yneg);
+
+  uint32_t* r = calloc(xn + yn + 1, sizeof(uint32_t));
+  lbig_mul_mag(r, xd, xn, yd, yn);
+  lval* v = lval_big(xneg ^ yneg, r, xn + yn);
+  lval_del(x);
+  return v;
+}
+
+// Quotient truncated toward zero like the division of long
+lval* lbig_div(lval* x, lval* y)
+{
+  if (LTYPE(x) == LVAL_VECTOR || LTYPE(y) == LVAL_VECTOR)
+    {
+      return lvec_op(x, y, LVEC_DIV);
+    }
+  if (LTYPE(x) == LVAL_DBL || LTYPE(y) == LVAL_DBL)
+    {
+      double d = lval_to_dbl(y);
+      lval* v = d != 0 ? lval_dbl(lval_to_dbl(x) / d) : lval_err("Division by zero!");
+      lval_del(x);
+      return v;
+    }
+  uint32_t xb[2], yb[2];
+  uint32_t* xd;
+  uint32_t* yd;
+  int xneg, yneg;
+  int xn = lbig_digits(x, xb, &xd, &xneg);
+  int yn = lbig_digits(y, yb, &yd, &yneg);
+  if (yn == 0)
+    {
+      lval_del(x);
+      return lval_err("Division by zero!");
+    }
+
+  lval* v;
+  if (lbig_cmp_mag(xd, xn, yd, yn) < 0) { v = lval_num(0); }
+  else
+    {
+      uint32_t* q = calloc(xn - yn + 1, sizeof(uint32_t));
+      lbig_div_mag(q, xd, xn, yd, yn);
+      v = lval_big(xneg ^ yneg, q, xn - yn + 1);
+    }
+  lval_del(x);
+  return v;
+}
+
+// Compares numbers of any size, negative if x < y
+int lbig_cmp(lval* x, lval* y)
+{
+  if (LTYPE(x) == LVAL_DBL || LTYPE(y) == LVAL_DBL)
+    {
+      double dx = lval_to_dbl(x);
+      double dy = lval_to_dbl(y);
+      return (dx > dy) - (dx < dy);
+    }
+  uint32_t xb[2], yb[2];
+  uint32_t* xd;
+  uint32_t* yd;
+  int xneg, yneg;
+  int xn = lbig_digits(x, xb, &xd, &xneg);
+  int yn = lbig_digits(y, yb, &yd, &yneg);
+  if (xneg != yneg) { return xneg ? -1 : 1; }
+  int c = lbig_cmp_mag(xd, xn, yd, yn);
+  return xneg ? -c : c;
+}
+
+// Number of the n decimal digits at s
+lval* lbig_read(char* s, size_t n, int neg)
+{
+  // Each digit takes a bit more than 3 bits
+  int size = n / 9 + 2;
+  uint32_t* d = calloc(size, sizeof(uint32_t));
+  int len = 0;
+  while (n)
+    {
+      // Up to 9 decimal digits at a time fit in a digit
+      uint32_t chunk = 0;
+      uint32_t scale = 1;
+      for (int k = 0; k < 9 && n; k++, n--, s++)
+        {
+          chunk = chunk * 10 + (*s - '0');
+          scale *= 10;
+        }
+      uint64_t carry = chunk;
+      for (int i = 0; i < len; i++)
+        {
+          carry += (uint64_t) d[i] * scale;
+          d[i] = (uint32_t) carry;
+          carry >>= 32;
+        }
+      if (carry) { d[len++] = (uint32_t) carry; }
+    }
+  return lval_big(neg, d, len);
+}
+
+void lbig_print(lval* v)
+{
+  // Split into base 10^9 chunks by repeated division, lowest first
+  int n = v->ndigits;
+  uint32_t* d = malloc(sizeof(uint32_t) * n);
+  memcpy(d, v->digits, sizeof(uint32_t) * n);
+  uint32_t* chunks = malloc(sizeof(uint32_t) * (n * 10 / 9 + 2));
+  int count = 0;
+  do
+    {
+      uint64_t rem = 0;
+      for (int i = n - 1; i >= 0; i--)
+        {
+          uint64_t t = (rem << 32) | d[i];
+          d[i] = (uint32_t) (t / 1000000000u);
+          rem = t % 1000000000u;
+        }
+      chunks[count++] = (uint32_t) rem;
+      while (n > 0 && d[n - 1] == 0) { n--; }
+    }
+  while (n > 0);
+
+  if (v->neg) { putchar('-'); }
+  printf("%u", (unsigned) chunks[count - 1]);
+  for (int i = count - 2; i >= 0; i--) { printf("%09u", (unsigned) chunks[i]); }
+  free(chunks);
+  free(d);
+}
+
+// Slow path of the arithmetic builtins, the fold is done again with big
+// numbers, doubles and vectors from the start. x is the initial value or
+// NULL to start from the first argument.
+lval* lval_fold_big(lval* a, lval* x, lval* (*op)(lval*, lval*))
+{
+  for (int i = 0; i < a->count; i++)
+    {
+      if (!LVAL_NUMERIC(a->cell[i]) && LTYPE(a->cell[i]) != LVAL_BOOL
+          && LTYPE(a->cell[i]) != LVAL_VECTOR)
+        {
+          if (x) { lval_del(x); }
+          return lval_fold_err(a);
+        }
+    }
+
+  // Initial value only matters for a single argument, in front of a
+  // vector it would just cost a pass over it
+  if (x && a->count > 1 && LTYPE(a->cell[0]) == LVAL_VECTOR)
+    {
+      lval_del(x);
+      x = NULL;
+    }
+  int i = 0;
+  if (!x && a->refs == 1 && lgc_mode == LGC_COPY)
+    {
+      // Taken out of the arguments, so a vector nothing else sees is
+      // updated in place
+      x = a->cell[i];
+      a->cell[i++] = lval_num(0);
+    }
+  else if (!x) { x = lval_copy(a->cell[i++]); }
+  for (; i < a->count && LTYPE(x) != LVAL_ERR; i++)
+    {
+      x = op(x, a->cell[i]);
+    }
+  lval_del(a);
+  return x;
+}
+
+lval* lval_dbl(double x)
+{
+  lval* v = lgc_alloc(LGC_LVAL, sizeof(lval));
+  v->type = LVAL_DBL;
+  v->refs = 1;
+  v->dbl = x;
+  return v;
+}
+
+// Value of number v of any type as double
+double lval_to_dbl(lval* v)
+{
+  switch (LTYPE(v))
+    {
+    case LVAL_DBL: return v->dbl;
+    case LVAL_BIG:
+      {
+        double x = 0;
+        for (int i = v->ndigits - 1; i >= 0; i--)
+          {
+            x = x * 4294967296.0 + v->digits[i];
+          }
+        return v->neg ? -x : x;
+      }
+    default: return (double) LNUM(v);
+    }
+}
+
+// Double of the n characters at s
+lval* ldbl_read(char* s, size_t n)
+{
+  char buf[64];
+  char* str = n < sizeof(buf) ? buf : malloc(n + 1);
+  memcpy(str, s, n);
+  str[n] = '\0';
+  double x = strtod(str, NULL);
+  if (str != buf) { free(str); }
+  return lval_dbl(x);
+}
+
+// Shortest form that reads back as the same double, it always has a
+// point or exponent so it is not read as integer
+void ldbl_print(double x)
+{
+  char buf[32];
+  int prec = 1;
+  snprintf(buf, sizeof(buf), "%.*g", prec, x);
+  while (prec < 17 && strtod(buf, NULL) != x)
+    {
+      snprintf(buf, sizeof(buf), "%.*g", ++prec, x);
+    }
+  // Below 1e16 more digits are used rather than an exponent
+  for (; prec <= 16 && strchr(buf, 'e'); prec++)
+    {
+      char fixed[32];
+      snprintf(fixed, sizeof(fixed), "%.*g", prec, x);
+      if (!strchr(fixed, 'e')) { strcpy(buf, fixed); }
+    }
+  if (!strpbrk(buf, ".in"))
+    {
+      // Readers need digits after a point before the exponent
+      char* exp = strchr(buf, 'e');
+      if (exp) { memmove(exp + 2, exp, strlen(exp) + 1); memcpy(exp, ".0", 2); }
+      else { strcat(buf, ".0"); }
+    }
+  fputs(buf, stdout);
+}
+
+// Reductions of a Q-Expression by +, *, min and max. Lists of fixnums or
+// of doubles only are handed to vector kernels, picked by lreduce_init
+// for the running CPU. Sums of fixnums are exact, sums and products of
+// doubles are added in lanes so rounding may differ from a fold.
+enum { LREDUCE_ADD, LREDUCE_MUL, LREDUCE_MIN, LREDUCE_MAX };
+
+// Kernel sets selected by --simd, capped by what the CPU supports
+enum { LSIMD_SCALAR, LSIMD_SSE42, LSIMD_AVX2 };
+int lsimd_level = LSIMD_AVX2;
+
+// Kernels of the packed doubles of vectors, these are needed without
+// LREDUCE_SIMD as well
+void lreduce_dbls_scalar(double* x, int n, int op, double* r)
+{
+  double acc = *r;
+  for (int i = 0; i < n; i++)
+    {
+      switch (op)
+        {
+        case LREDUCE_ADD: acc += x[i]; break;
+        case LREDUCE_MUL: acc *= x[i]; break;
+        case LREDUCE_MIN: if (x[i] < acc) { acc = x[i]; } break;
+        case LREDUCE_MAX: if (x[i] > acc) { acc = x[i]; } break;
+        }
+    }
+  *r = acc;
+}
+
+double lreduce_dot_scalar(double* x, double* y, int n)
+{
+  double acc = 0;
+  for (int i = 0; i < n; i++) { acc += x[i] * y[i]; }
+  return acc;
+}
+
+#ifdef LREDUCE_SIMD
+// Fixnum words w = 4x + 1 are summed biased by 2^63 as unsigned high and
+// low halves, neither overflows for less than 2^32 elements.
+// Kernels return 0 if an element is not a fixnum. They run over the
+// untagged longs of vectors as well, which ignore that.
+int lreduce_fix_sum_scalar(uintptr_t* w, int n, uint64_t* hi, uint64_t* lo)
+{
+  uintptr_t all = LTAG_FIX;
+  uint64_t h = 0;
+  uint64_t l = 0;
+  for (int i = 0; i < n; i++)
+    {
+      uint64_t u = (uint64_t) w[i] ^ 0x8000000000000000u;
+      all &= w[i];
+      h += u >> 32;
+      l += u & 0xffffffffu;
+    }
+  *hi += h;
+  *lo += l;
+  return all & LTAG_FIX;
+}
+
+// Fixnum words keep the order of their numbers, so the smallest or
+// largest word is compared as is
+int lreduce_fix_pick_scalar(uintptr_t* w, int n, int max, intptr_t* r)
+{
+  uintptr_t all = LTAG_FIX;
+  intptr_t best = *r;
+  for (int i = 0; i < n; i++)
+    {
+      intptr_t x = (intptr_t) w[i];
+      all &= w[i];
+      if (max ? x > best : x < best) { best = x; }
+    }
+  *r = best;
+  return all & LTAG_FIX;
+}
+
+// Doubles are boxed, kernels return 0 if an element is something else
+int lreduce_dbl_scalar(lval** cell, int n, int op, double* r)
+{
+  double x = *r;
+  for (int i = 0; i < n; i++)
+    {
+      lval* v = cell[i];
+      if (LVAL_IMM(v) || v->type != LVAL_DBL) { return 0; }
+      switch (op)
+        {
+        case LREDUCE_ADD: x += v->dbl; break;
+        case LREDUCE_MUL: x *= v->dbl; break;
+        case LREDUCE_MIN: if (v->dbl < x) { x = v->dbl; } break;
+        case LREDUCE_MAX: if (v->dbl > x) { x = v->dbl; } break;
+        }
+    }
+  *r = x;
+  return 1;
+}
+
+// Adds lanes of a vector kernel into *r, lanes of min and max started
+// from *r
+void lreduce_lanes(double* lanes, int op, double* r)
+{
+  switch (op)
+    {
+    case LREDUCE_ADD: *r += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]); break;
+    case LREDUCE_MUL: *r *= (lanes[0] * lanes[1]) * (lanes[2] * lanes[3]); break;
+    case LREDUCE_MIN:
+    case LREDUCE_MAX:
+      for (int k = 0; k < 4; k++)
+        {
+          if (op == LREDUCE_MIN ? lanes[k] < *r : lanes[k] > *r) { *r = lanes[k]; }
+        }
+      break;
+    }
+}
+
+__attribute__((target("sse4.2")))
+int lreduce_fix_sum_sse42(uintptr_t* w, int n, uint64_t* hi, uint64_t* lo)
+{
+  __m128i bias = _mm_set1_epi64x((long long) 0x8000000000000000u);
+  __m128i low = _mm_set1_epi64x(0xffffffff);
+  __m128i all = _mm_set1_epi64x(-1);
+  __m128i h = _mm_setzero_si128();
+  __m128i l = _mm_setzero_si128();
+  int i = 0;
+  for (; i + 2 <= n; i += 2)
+    {
+      __m128i x = _mm_loadu_si128((__m128i*) (w + i));
+      __m128i u = _mm_xor_si128(x, bias);
+      all = _mm_and_si128(all, x);
+      h = _mm_add_epi64(h, _mm_srli_epi64(u, 32));
+      l = _mm_add_epi64(l, _mm_and_si128(u, low));
+    }
+  uint64_t th[2], tl[2], ta[2];
+  _mm_storeu_si128((__m128i*) th, h);
+  _mm_storeu_si128((__m128i*) tl, l);
+  _mm_storeu_si128((__m128i*) ta, all);
+  *hi += th[0] + th[1];
+  *lo += tl[0] + tl[1];
+  int tail = lreduce_fix_sum_scalar(w + i, n - i, hi, lo);
+  return (ta[0] & ta[1] & LTAG_FIX) && tail;
+}
+
+__attribute__((target("sse4.2")))
+int lreduce_fix_pick_sse42(uintptr_t* w, int n, int max, intptr_t* r)
+{
+  __m128i all = _mm_set1_epi64x(-1);
+  __m128i best = _mm_set1_epi64x(*r);
+  int i = 0;
+  for (; i + 2 <= n; i += 2)
+    {
+      __m128i x = _mm_loadu_si128((__m128i*) (w + i));
+      all = _mm_and_si128(all, x);
+      __m128i gt = max ? _mm_cmpgt_epi64(x, best) : _mm_cmpgt_epi64(best, x);
+      best = _mm_blendv_epi8(best, x, gt);
+    }
+  intptr_t tb[2];
+  uint64_t ta[2];
+  _mm_storeu_si128((__m128i*) tb, best);
+  _mm_storeu_si128((__m128i*) ta, all);
+  for (int k = 0; k < 2; k++)
+    {
+      if (max ? tb[k] > *r : tb[k] < *r) { *r = tb[k]; }
+    }
+  int tail = lreduce_fix_pick_scalar(w + i, n - i, max, r);
+  return (ta[0] & ta[1] & LTAG_FIX) && tail;
+}
+
+__attribute__((target("avx2")))
+int lreduce_fix_sum_avx2(uintptr_t* w, int n, uint64_t* hi, uint64_t* lo)
+{
+  __m256i bias = _mm256_set1_epi64x((long long) 0x8000000000000000u);
+  __m256i low = _mm256_set1_epi64x(0xffffffff);
+  __m256i all = _mm256_set1_epi64x(-1);
+  __m256i h = _mm256_setzero_si256();
+  __m256i l = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 4 <= n; i += 4)
+    {
+      __m256i x = _mm256_loadu_si256((__m256i*) (w + i));
+      __m256i u = _mm256_xor_si256(x, bias);
+      all = _mm256_and_si256(all, x);
+      h = _mm256_add_epi64(h, _mm256_srli_epi64(u, 32));
+      l = _mm256_add_epi64(l, _mm256_and_si256(u, low));
+    }
+  uint64_t th[4], tl[4], ta[4];
+  _mm256_storeu_si256((__m256i*) th, h);
+  _mm256_storeu_si256((__m256i*) tl, l);
+  _mm256_storeu_si256((__m256i*) ta, all);
+  *hi += th[0] + th[1] + th[2] + th[3];
+  *lo += tl[0] + tl[1] + tl[2] + tl[3];
+  int tail = lreduce_fix_sum_scalar(w + i, n - i, hi, lo);
+  return (ta[0] & ta[1] & ta[2] & ta[3] & LTAG_FIX) && tail;
+}
+
+__attribute__((target("avx2")))
+int lreduce_fix_pick_avx2(uintptr_t* w, int n, int max, intptr_t* r)
+{
+  __m256i all = _mm256_set1_epi64x(-1);
+  __m256i best = _mm256_set1_epi64x(*r);
+  int i = 0;
+  for (; i + 4 <= n; i += 4)
+    {
+      __m256i x = _mm256_loadu_si256((__m256i*) (w + i));
+      all = _mm256_and_si256(all, x);
+      __m256i gt = max ? _mm256_cmpgt_epi64(x, best) : _mm256_cmpgt_epi64(best, x);
+      best = _mm256_blendv_epi8(best, x, gt);
+    }
+  intptr_t tb[4];
+  uint64_t ta[4];
+  _mm256_storeu_si256((__m256i*) tb, best);
+  _mm256_storeu_si256((__m256i*) ta, all);
+  for (int k = 0; k < 4; k++)
+    {
+      if (max ? tb[k] > *r : tb[k] < *r) { *r = tb[k]; }
+    }
+  int tail = lreduce_fix_pick_scalar(w + i, n - i, max, r);
+  return (ta[0] & ta[1] & ta[2] & ta[3] & LTAG_FIX) && tail;
+}
+
+// Values are gathered from the boxes, addresses are taken relative to
+// the first element
+__attribute__((target("avx2")))
+int lreduce_dbl_avx2(lval** cell, int n, int op, double* r)
+{
+  char* base = (char*) cell[0];
+  if (LVAL_IMM(cell[0])) { return 0; }
+  __m256i origin = _mm256_set1_epi64x((long long) (uintptr_t) base);
+  __m256i tags = _mm256_set1_epi64x(LTAG_MASK);
+  __m128i type = _mm_set1_epi32(LVAL_DBL);
+  __m128i bad = _mm_setzero_si128();
+  __m256d acc = _mm256_set1_pd(op == LREDUCE_ADD ? 0 : op == LREDUCE_MUL ? 1 : *r);
+  int i = 0;
+  for (; i + 4 <= n; i += 4)
+    {
+      __m256i p = _mm256_loadu_si256((__m256i*) (cell + i));
+      // Immediates must not be dereferenced
+      if (!_mm256_testz_si256(p, tags)) { return 0; }
+      __m256i off = _mm256_sub_epi64(p, origin);
+      __m128i t = _mm256_i64gather_epi32((int*) (base + offsetof(lval, type)), off, 1);
+      bad = _mm_or_si128(bad, _mm_xor_si128(t, type));
+      __m256d v = _mm256_i64gather_pd((double*) (base + offsetof(lval, dbl)), off, 1);
+      switch (op)
+        {
+        case LREDUCE_ADD: acc = _mm256_add_pd(acc, v); break;
+        case LREDUCE_MUL: acc = _mm256_mul_pd(acc, v); break;
+        case LREDUCE_MIN: acc = _mm256_min_pd(acc, v); break;
+        case LREDUCE_MAX: acc = _mm256_max_pd(acc, v); break;
+        }
+    }
+  if (!_mm_testz_si128(bad, bad)) { return 0; }
+
+  double lanes[4];
+  _mm256_storeu_pd(lanes, acc);
+  lreduce_lanes(lanes, op, r);
+  return lreduce_dbl_scalar(cell + i, n - i, op, r);
+}
+
+// Doubles of vectors are packed, so they are just loaded
+__attribute__((target("avx2")))
+void lreduce_dbls_avx2(double* x, int n, int op, double* r)
+{
+  __m256d acc = _mm256_set1_pd(op == LREDUCE_ADD ? 0 : op == LREDUCE_MUL ? 1 : *r);
+  int i = 0;
+  for (; i + 4 <= n; i += 4)
+    {
+      __m256d v = _mm256_loadu_pd(x + i);
+      switch (op)
+        {
+        case LREDUCE_ADD: acc = _mm256_add_pd(acc, v); break;
+        case LREDUCE_MUL: acc = _mm256_mul_pd(acc, v); break;
+        case LREDUCE_MIN: acc = _mm256_min_pd(acc, v); break;
+        case LREDUCE_MAX: acc = _mm256_max_pd(acc, v); break;
+        }
+    }
+  double lanes[4];
+  _mm256_storeu_pd(lanes, acc);
+  lreduce_lanes(lanes, op, r);
+  lreduce_dbls_scalar(x + i, n - i, op, r);
+}
+
+__attribute__((target("avx2")))
+double lreduce_dot_avx2(double* x, double* y, int n)
+{
+  __m256d acc = _mm256_setzero_pd();
+  int i = 0;
+  for (; i + 4 <= n; i += 4)
+    {
+      __m256d p = _mm256_mul_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i));
+      acc = _mm256_add_pd(acc, p);
+    }
+  double lanes[4];
+  _mm256_storeu_pd(lanes, acc);
+  return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3])
+    + lreduce_dot_scalar(x + i, y + i, n - i);
+}
+
+int (*lreduce_fix_sum)(uintptr_t* w, int n, uint64_t* hi, uint64_t* lo) = lreduce_fix_sum_scalar;
+int (*lreduce_fix_pick)(uintptr_t* w, int n, int max, intptr_t* r) = lreduce_fix_pick_scalar;
+int (*lreduce_dbl)(lval** cell, int n, int op, double* r) = lreduce_dbl_scalar;
+#endif
+void (*lreduce_dbls)(double* x, int n, int op, double* r) = lreduce_dbls_scalar;
+double (*lreduce_dot)(double* x, double* y, int n) = lreduce_dot_scalar;
+
+// Picks the kernels for the CPU, at most at lsimd_level
+void lreduce_init(void)
+{
+#ifdef LREDUCE_SIMD
+  __builtin_cpu_init();
+  if (lsimd_level >= LSIMD_AVX2 && __builtin_cpu_supports("avx2"))
+    {
+      lreduce_fix_sum = lreduce_fix_sum_avx2;
+      lreduce_fix_pick = lreduce_fix_pick_avx2;
+      lreduce_dbl = lreduce_dbl_avx2;
+      lreduce_dbls = lreduce_dbls_avx2;
+      lreduce_dot = lreduce_dot_avx2;
+    }
+  else if (lsimd_level >= LSIMD_SSE42 && __builtin_cpu_supports("sse4.2"))
+    {
+      lreduce_fix_sum = lreduce_fix_sum_sse42;
+      lreduce_fix_pick = lreduce_fix_pick_sse42;
+    }
+#endif
+}
+
+#ifdef LREDUCE_SIMD
+// Number of exact result s of a kernel
+lval* lreduce_int128(__int128 s)
+{
+  if (s >= LONG_MIN && s <= LONG_MAX) { return lval_num((long) s); }
+  unsigned __int128 m = s < 0 ? -(unsigned __int128) s : (unsigned __int128) s;
+  uint32_t* d = malloc(sizeof(uint32_t) * 4);
+  for (int k = 0; k < 4; k++) { d[k] = (uint32_t) (m >> (32 * k)); }
+  return lval_big(s < 0, d, 4);
+}
+
+// Sum, min or max of n words by the fixnum kernels. Tagged words must be
+// fixnums or NULL is returned, untagged ones are longs.
+lval* lreduce_words(uintptr_t* w, int n, int op, int tagged)
+{
+  if (op == LREDUCE_ADD)
+    {
+      uint64_t hi = 0;
+      uint64_t lo = 0;
+      if (!lreduce_fix_sum(w, n, &hi, &lo) && tagged) { return NULL; }
+      // Remove the bias and the tags, the result is exact
+      __int128 s = (__int128) (((unsigned __int128) hi << 32) + lo)
+        - ((__int128) n << 63);
+      if (tagged) { s = (s - n) / 4; }
+      return lreduce_int128(s);
+    }
+  intptr_t r = (intptr_t) w[0];
+  if (!lreduce_fix_pick(w, n, op == LREDUCE_MAX, &r) && tagged) { return NULL; }
+  return tagged ? (lval*) r : lval_num(r);
+}
+#endif
+
+// Reduction of the elements of q by a kernel, NULL if they are not all
+// fixnums or all doubles
+lval* lreduce(lval* q, int op)
+{
+#ifdef LREDUCE_SIMD
+  if (q->count == 0) { return NULL; }
+  lval** cell = q->cell;
+  int n = q->count;
+  if (LVAL_IMM(cell[0]) && op != LREDUCE_MUL)
+    {
+      return lreduce_words((uintptr_t*) cell, n, op, 1);
+    }
+  if (!LVAL_IMM(cell[0]) && cell[0]->type == LVAL_DBL)
+    {
+      double r = op == LREDUCE_ADD ? 0 : op == LREDUCE_MUL ? 1 : cell[0]->dbl;
+      if (!lreduce_dbl(cell, n, op, &r)) { return NULL; }
+      return lval_dbl(r);
+    }
+#endif
+  return NULL;
+}
+
+// Vectors hold longs or doubles side by side, 8 bytes per element
+// instead of a cell pointer and a box for each. Arithmetic on them runs
+// in plain loops over the arrays.
+lval* lval_vector(int len, int is_dbl)
+{
+  lval* v = lgc_alloc(LGC_LVAL, sizeof(lval));
+  v->type = LVAL_VECTOR;
+  v->refs = 1;
+  v->len = len;
+  v->is_dbl = is_dbl;
+  v->longs = lalloc(LVEC_BYTES(v));
+  return v;
+}
+
+// Element i of vector v as number
+lval* lvec_get(lval* v, int i)
+{
+  return v->is_dbl ? lval_dbl(v->dbls[i]) : lval_num(v->longs[i]);
+}
+
+// Turns the first n longs of v into doubles in place
+void lvec_to_dbl(lval* v, int n)
+{
+  for (int i = 0; i < n; i++)
+    {
+      long x = v->longs[i];
+      v->dbls[i] = (double) x;
+    }
+  v->is_dbl = 1;
+}
+
+// Loops of lvec_op with the strides spelled out as constants, so each
+// is a plain stream. A scalar operand has stride 0.
+#define LVEC_LOOP(T, x, xs, y, ys, n, BODY)     \
+  for (int i = 0; i < (n); i++)                 \
+    {                                           \
+      T a = (x)[i * (xs)];                      \
+      T b = (y)[i * (ys)];                      \
+      BODY;                                     \
+    }
+
+#define LVEC_EACH(T, x, xs, y, ys, n, BODY)                     \
+  if (!(xs)) { LVEC_LOOP(T, x, 0, y, 1, n, BODY) }              \
+  else if (!(ys)) { LVEC_LOOP(T, x, 1, y, 0, n, BODY) }         \
+  else { LVEC_LOOP(T, x, 1, y, 1, n, BODY) }
+
+// Doubles of operand v, a number is stored at s. Longs of a vector are
+// converted into a new array the caller frees.
+double* lvec_dbl_arg(lval* v, double* s, int* stride)
+{
+  *stride = LTYPE(v) == LVAL_VECTOR;
+  if (!*stride)
+    {
+      *s = lval_to_dbl(v);
+      return s;
+    }
+  if (v->is_dbl) { return v->dbls; }
+  double* d = lalloc(sizeof(double) * v->len);
+  for (int i = 0; i < v->len; i++) { d[i] = (double) v->longs[i]; }
+  return d;
+}
+
+void lvec_dbl_arg_del(lval* v, double* d)
+{
+  if (LTYPE(v) == LVAL_VECTOR && !v->is_dbl) { lfree(d, sizeof(double) * v->len); }
+}
+
+// r = x op y on doubles, error message or NULL
+char* lvec_op_dbl(double* r, lval* x, lval* y, int n, int op)
+{
+  double xv, yv;
+  int xs, ys;
+  double* p = lvec_dbl_arg(x, &xv, &xs);
+  double* q = lvec_dbl_arg(y, &yv, &ys);
+  int zero = 0;
+  switch (op)
+    {
+    case LVEC_ADD: LVEC_EACH(double, p, xs, q, ys, n, r[i] = a + b); break;
+    case LVEC_SUB: LVEC_EACH(double, p, xs, q, ys, n, r[i] = a - b); break;
+    case LVEC_MUL: LVEC_EACH(double, p, xs, q, ys, n, r[i] = a * b); break;
+    case LVEC_DIV:
+      LVEC_EACH(double, p, xs, q, ys, n, zero |= b == 0; r[i] = a / b);
+      break;
+    }
+  lvec_dbl_arg_del(x, p);
+  lvec_dbl_arg_del(y, q);
+  return zero ? "Division by zero!" : NULL;
+}
+
+// r = x op y on longs. Overflow is only collected in the sign bit of
+// ovf, so the loops have no branches.
+char* lvec_op_long(long* r, lval* x, lval* y, int n, int op)
+{
+  long xv = LTYPE(x) == LVAL_VECTOR ? 0 : LNUM(x);
+  long yv = LTYPE(y) == LVAL_VECTOR ? 0 : LNUM(y);
+  int xs = LTYPE(x) == LVAL_VECTOR;
+  int ys = LTYPE(y) == LVAL_VECTOR;
+  long* p = xs ? x->longs : &xv;
+  long* q = ys ? y->longs : &yv;
+  long ovf = 0;
+  int zero = 0;
+  switch (op)
+    {
+    case LVEC_ADD:
+      LVEC_EACH(long, p, xs, q, ys, n,
+                long c = (long) ((unsigned long) a + (unsigned long) b);
+                ovf |= (a ^ c) & (b ^ c);
+                r[i] = c);
+      break;
+    case LVEC_SUB:
+      LVEC_EACH(long, p, xs, q, ys, n,
+                long c = (long) ((unsigned long) a - (unsigned long) b);
+                ovf |= (a ^ b) & (a ^ c);
+                r[i] = c);
+      break;
+    case LVEC_MUL:
+      LVEC_EACH(long, p, xs, q, ys, n,
+                if (LMUL_OVERFLOW(a, b, &r[i])) { ovf = -1; });
+      break;
+    case LVEC_DIV:
+      LVEC_EACH(long, p, xs, q, ys, n,
+                if (b == 0) { zero = 1; break; }
+                // Only LONG_MIN / -1 is out of range
+                if (b == -1 && a == LONG_MIN) { ovf = -1; break; }
+                r[i] = a / b);
+      break;
+    }
+  if (zero) { return "Division by zero!"; }
+  return ovf < 0 ? "Vector element out of range" : NULL;
+}
+
+// Element-wise x op y, one of them is a vector and the other a vector of
+// the same length or a number. Takes over x, y is borrowed. Elements are
+// longs unless one side has doubles. Results that overflow long are an
+// error, vectors have no room for big numbers.
+lval* lvec_op(lval* x, lval* y, int op)
+{
+  if (LTYPE(x) == LVAL_BIG || LTYPE(y) == LVAL_BIG)
+    {
+      lval_del(x);
+      return lval_err("Vector element out of range");
+    }
+  if (LTYPE(x) == LVAL_VECTOR && LTYPE(y) == LVAL_VECTOR && x->len != y->len)
+    {
+      lval* err = lval_err("Vector lengths differ. Got %i and %i.",
+                           x->len, y->len);
+      lval_del(x);
+      return err;
+    }
+  int n = LTYPE(x) == LVAL_VECTOR ? x->len : y->len;
+  int dbl = LVEC_DBL(x) || LVEC_DBL(y);
+
+  // Result is written over x if nothing else sees it
+  int in_place = LTYPE(x) == LVAL_VECTOR && x->is_dbl == dbl
+    && x->refs == 1 && lgc_mode == LGC_COPY;
+  lval* r = in_place ? x : lval_vector(n, dbl);
+  char* err = dbl ? lvec_op_dbl(r->dbls, x, y, n, op)
+    : lvec_op_long(r->longs, x, y, n, op);
+  if (!in_place) { lval_del(x); }
+  if (err)
+    {
+      lval_del(r);
+      return lval_err(err);
+    }
+  return r;
+}
+
+// Slow path of sums, products and dot products of longs that overflow,
+// done again with big numbers. b is NULL unless it is a dot product.
+lval* lvec_fold_big(long* a, long* b, int n, int op)
+{
+  lval* x = lval_num(op == LREDUCE_MUL);
+  for (int i = 0; i < n; i++)
+    {
+      lval* y = lval_num(a[i]);
+      if (b)
+        {
+          lval* z = lval_num(b[i]);
+          y = lbig_mul(y, z);
+          lval_del(z);
+        }
+      x = op == LREDUCE_MUL ? lbig_mul(x, y) : lbig_add(x, y);
+      lval_del(y);
+    }
+  return x;
+}
+
+lval* lvec_reduce_long(lval* v, int op)
+{
+  long* a = v->longs;
+  int n = v->len;
+#ifdef LREDUCE_SIMD
+  if (op != LREDUCE_MUL) { return lreduce_words((uintptr_t*) a, n, op, 0); }
+#endif
+  long acc = op == LREDUCE_ADD ? 0 : op == LREDUCE_MUL ? 1 : a[0];
+  for (int i = 0; i < n; i++)
+    {
+      switch (op)
+        {
+        case LREDUCE_ADD:
+          if (LADD_OVERFLOW(acc, a[i], &acc)) { return lvec_fold_big(a, NULL, n, op); }
+          break;
+        case LREDUCE_MUL:
+          if (LMUL_OVERFLOW(acc, a[i], &acc)) { return lvec_fold_big(a, NULL, n, op); }
+          break;
+        case LREDUCE_MIN: if (a[i] < acc) { acc = a[i]; } break;
+        case LREDUCE_MAX: if (a[i] > acc) { acc = a[i]; } break;
+        }
+    }
+  return lval_num(acc);
+}
+
+// Reduction of the elements of vector v, which it takes over
+lval* lvec_reduce(lval* v, int op)
+{
+  lval* x;
+  if (v->len == 0 && (op == LREDUCE_MIN || op == LREDUCE_MAX))
+    {
+      x = lval_err("Function '%s' passed no arguments.",
+                   op == LREDUCE_MIN ? "min" : "max");
+    }
+  else if (v->is_dbl)
+    {
+      double r = op == LREDUCE_ADD ? 0 : op == LREDUCE_MUL ? 1 : v->dbls[0];
+      lreduce_dbls(v->dbls, v->len, op, &r);
+      x = lval_dbl(r);
+    }
+  else
+    {
+      x = lvec_reduce_long(v, op);
+    }
+  lval_del(v);
+  return x;
+}
+
+// Dot product of vectors of the same length
+lval* lvec_dot(lval* x, lval* y)
+{
+  int n = x->len;
+  if (x->is_dbl || y->is_dbl)
+    {
+      int stride;
+      double* p = lvec_dbl_arg(x, NULL, &stride);
+      double* q = lvec_dbl_arg(y, NULL, &stride);
+      double r = lreduce_dot(p, q, n);
+      lvec_dbl_arg_del(x, p);
+      lvec_dbl_arg_del(y, q);
+      return lval_dbl(r);
+    }
+#ifdef LREDUCE_SIMD
+  // Products always fit in 128 bits, their sum nearly always
+  __int128 acc = 0;
+  for (int i = 0; i < n; i++)
+    {
+      if (__builtin_add_overflow(acc, (__int128) x->longs[i] * y->longs[i], &acc))
+        {
+          return lvec_fold_big(x->longs, y->longs, n, LREDUCE_ADD);
+        }
+    }
+  return lreduce_int128(acc);
+#else
+  long acc = 0;
+  for (int i = 0; i < n; i++)
+    {
+      long p;
+      if (LMUL_OVERFLOW(x->longs[i], y->longs[i], &p)
+          || LADD_OVERFLOW(acc, p, &acc))
+        {
+          return lvec_fold_big(x->longs, y->longs, n, LREDUCE_ADD);
+        }
+    }
+  return lval_num(acc);
+#endif
+}
+
+// Function makes default user function
+// Formals are arugments of this function and body is body of it
+lval* lval_lambda(lval* formals, lval* body)
+{
+  lval* v = lgc_alloc(LGC_LVAL, sizeof(lval));
+  v->type = LVAL_FUN;
+  v->refs = 1;
+
+  // Set builtin to null
+  v->builtin = NULL;
+  // Build new enviroment
+  v->env = lenv_new_frame(formals->count);
+  // Set formals and body
+  v->formals = formals;
+  v->body = body;
+  return v;
+}
+
+lval* lval_boolean(long x)
+{
+  return (lval*) (((uintptr_t) !!x << 2) | LTAG_BOOL);
+}
+ 
+// make a new func
+lval* lval_fun(lbuiltin func)
+{
+  lval* v = lgc_alloc(LGC_LVAL, sizeof(lval));
+  v->type = LVAL_FUN;
+  v->refs = 1;
+  v->builtin = func;
+  return v;
+}
+
+// Construct a pointer to a new error type lval
+lval* lval_err(char* fmt, ...)
+{
+  lval* v = lgc_alloc(LGC_LVAL, sizeof(lval));
+  v->type = LVAL_ERR;
+  v->refs = 1;
+
+  // Create a va list and init it
+  va_list va;
+  va_start(va, fmt);
+  // Alloc buffer
+  v->err = malloc(512);
   // Print error string with 511 chars only
   vsnprintf(v->err, 511, fmt, va);
   // Realocate the size of the error msg
@@ -386,49 +2414,78 @@ lval* lval_err(char* fmt, ...)
 // Construct a pointer to a new symbol type lval
 lval* lval_sym(char* s)
 {
-  lval* v = malloc(sizeof(lval));
+  return lval_sym_len(s, strlen(s));
+}
+
+lval* lval_sym_len(char* s, size_t n)
+{
+  lval* v = lgc_alloc(LGC_LVAL, sizeof(lval));
   v->type = LVAL_SYM;
-  v->sym = malloc(strlen(s) + 1);
-  strcpy(v->sym, s);
+  v->refs = 1;
+  v->sym = sym_intern_len(s, n);
+  v->depth = -1;
+  v->cache = NULL;
   return v;
 }
 
 lval* lval_str(char* s)
 {
-  lval* v = malloc(sizeof(lval));
+  return lval_str_len(s, strlen(s));
+}
+
+// String of first n characters of s
+lval* lval_str_len(char* s, size_t n)
+{
+  lval* v = lgc_alloc(LGC_LVAL, sizeof(lval));
   v->type = LVAL_STRING;
-  v->str = malloc(strlen(s) + 1);
-  strcpy(v->str, s);
+  v->refs = 1;
+  v->str = malloc(n + 1);
+  memcpy(v->str, s, n);
+  v->str[n] = '\0';
   return v;
 }
 
 lval* lval_sexpr(void)
 {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lgc_alloc(LGC_LVAL, sizeof(lval));
   v->type = LVAL_SEXPR;
+  v->refs = 1;
   v->count = 0;
+  v->cap = 0;
+  v->start = 0;
   v->cell = NULL;
+  v->code = NULL;
   return v;
 }
 
 lval* lval_qexpr(void)
 {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lgc_alloc(LGC_LVAL, sizeof(lval));
   v->type = LVAL_QEXPR;
+  v->refs = 1;
   v->count = 0;
+  v->cap = 0;
+  v->start = 0;
   v->cell = NULL;
+  v->code = NULL;
   return v;
 }
 
-// Delete the structure
+// Drop one reference, the structure is deleted by its last owner.
+// Traced values are freed by the collector only.
 void lval_del(lval* v)
 {
+  if (LVAL_IMM(v) || lgc_mode == LGC_TRACE || --v->refs > 0) { return; }
+
   switch (v->type)
     {
     case LVAL_NUM: break;
+    case LVAL_DBL: break;
+    case LVAL_BIG: free(v->digits); break;
+    case LVAL_VECTOR: lfree(v->longs, LVEC_BYTES(v)); break;
     case LVAL_ERR: free(v->err); break;
-    case LVAL_BOOL:
-    case LVAL_SYM: free(v->sym); break;
+    // Symbol names are interned and never freed
+    case LVAL_SYM: break;
     case LVAL_STRING: free(v->str); break;
     case LVAL_FUN:
       if (!v->builtin)
@@ -438,6 +2495,10 @@ void lval_del(lval* v)
           lval_del(v->body);
         }
       break;
+    case LVAL_TAIL:
+      lenv_del(v->env);
+      lval_del(v->body);
+      break;
     // If Qexpr or Sexpr then delete all elements inside
     case LVAL_QEXPR:  
     case LVAL_SEXPR:
@@ -445,18 +2506,23 @@ void lval_del(lval* v)
         {
           lval_del(v->cell[i]);
         }
-      free(v->cell);
+      if (v->cap) { lfree(v->cell - v->start, sizeof(lval*) * v->cap); }
+      if (v->code) { lcode_del(v->code); }
       break;
     }
-  free(v);
+  lfree(v, sizeof(lval));
 }
 
 
 lval* lval_read_num(mpc_ast_t* t)
 {
   errno = 0;
+  if (strchr(t->contents, '.')) { return ldbl_read(t->contents, strlen(t->contents)); }
   long x = strtol(t->contents, NULL, 10);
-  return errno != ERANGE ? lval_num(x) : lval_err("invalid number");
+  if (errno != ERANGE) { return lval_num(x); }
+  int neg = t->contents[0] == '-';
+  char* s = t->contents + neg;
+  return lbig_read(s, strlen(s), neg);
 }
 
 lval* lval_read_str(mpc_ast_t* t)
@@ -479,11 +2545,11 @@ lval* lval_read_boolean(char* s)
 {
   if (strcmp(s, "True") == 0)
     {
-      return lval_boolean(1, s);
+      return lval_boolean(1);
     }
   else if (strcmp(s, "False") == 0)
     {
-      return lval_boolean(0, s);
+      return lval_boolean(0);
     }
   else
     {
@@ -493,22 +2559,46 @@ lval* lval_read_boolean(char* s)
 
 int lval_eq(lval* x, lval* y)
 {
+  // Numbers are equal by value whatever their type, the same as < and >
+  // order them
+  if (LVAL_NUMERIC(x) && LVAL_NUMERIC(y))
+    {
+      // In double like lbig_cmp, but NaN is equal to nothing
+      if (LTYPE(x) == LVAL_DBL || LTYPE(y) == LVAL_DBL)
+        {
+          return lval_to_dbl(x) == lval_to_dbl(y);
+        }
+      return LNUM_CMP(x, y) == 0;
+    }
+
   // Different types are always unequal
-  if (x->type != y->type)
+  if (LTYPE(x) != LTYPE(y))
     {
       return 0;
     }
 
   // Comparision based upon the type
-  switch (x->type)
+  switch (LTYPE(x))
     {
       //compare no value
-    case LVAL_BOOL:
-    case LVAL_NUM: return (x->num == y->num);
+    case LVAL_BOOL: return (LNUM(x) == LNUM(y));
+    case LVAL_VECTOR:
+      if (x->len != y->len) { return 0; }
+      for (int i = 0; i < x->len; i++)
+        {
+          if (!x->is_dbl && !y->is_dbl
+              ? x->longs[i] != y->longs[i]
+              : (x->is_dbl ? x->dbls[i] : (double) x->longs[i])
+              != (y->is_dbl ? y->dbls[i] : (double) y->longs[i]))
+            {
+              return 0;
+            }
+        }
+      return 1;
       
     // compare string value
     case LVAL_ERR: return (strcmp(x->err, y->err) == 0);
-    case LVAL_SYM: return (strcmp(x->sym, y->sym) == 0);
+    case LVAL_SYM: return (x->sym == y->sym);
     case LVAL_STRING: return (strcmp(x->str, y->str) == 0);
 
       // compare funcitons
@@ -544,21 +2634,53 @@ int lval_eq(lval* x, lval* y)
   return 0;
 }
 
+// Move elements into new array with front free slots in front
+// and room for at least n elements after them
+void lval_resize(lval* v, int front, int n)
+{
+  int cap = v->cap ? v->cap : 4;
+  while (cap < front + n) { cap *= 2; }
+  lval** cell = lalloc(sizeof(lval*) * cap);
+  if (v->count) { memcpy(cell + front, v->cell, sizeof(lval*) * v->count); }
+  if (v->cap) { lfree(v->cell - v->start, sizeof(lval*) * v->cap); }
+  v->cell = cell + front;
+  v->start = front;
+  v->cap = cap;
+}
+
+// Make room for n more elements at the end
+void lval_reserve(lval* v, int n)
+{
+  if (v->start + v->count + n <= v->cap) { return; }
+  // Reuse space left by pops from the front if it is enough
+  if (v->count + n <= v->cap && v->start >= v->cap / 2)
+    {
+      memmove(v->cell - v->start, v->cell, sizeof(lval*) * v->count);
+      v->cell -= v->start;
+      v->start = 0;
+      return;
+    }
+  // Grow geometrically, appending is amortized O(1)
+  lval_resize(v, 0, v->count + n > 2 * v->count ? v->count + n : 2 * v->count);
+}
+
 lval* lval_add(lval* v, lval* x)
 {
-  v->count++;
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-  v->cell[v->count-1] = x;
+  lval_reserve(v, 1);
+  v->cell[v->count++] = x;
   return v;
 }
 
 lval* lval_add_front(lval* v, lval* x)
 {
-  // Number of elements before realloc
-  int cells_no = v->count;
+  if (v->start == 0)
+    {
+      // Leave as much room in front as there are elements
+      lval_resize(v, v->count + 1, 2 * v->count + 1);
+    }
+  v->cell--;
+  v->start--;
   v->count++;
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-  memmove(&v->cell[1], &v->cell[0], sizeof(lval*) * cells_no);
   v->cell[0] = x;
   return v;
 }
@@ -569,6 +2691,10 @@ lval* lval_call (lenv* e, lval* f, lval* a)
   // if builtin the apply this builtin
   if (f->builtin) { return f->builtin(e, a); }
 
+  // f is shared with the caller, bind arguments into a private copy
+  f = lval_unshare(lval_copy(f));
+  f->formals = lval_unshare(f->formals);
+
   // check how many arguments passed to the function
   // and how many arguments can be passed
   int given = a->count;
@@ -581,6 +2707,7 @@ lval* lval_call (lenv* e, lval* f, lval* a)
       if (f->formals->count == 0)
         {
           lval_del(a);
+          lval_del(f);
           return lval_err("Function passed to many arguments. "
                           "Got %i, Expected %i.", given, total);
         }
@@ -595,6 +2722,7 @@ lval* lval_call (lenv* e, lval* f, lval* a)
           if (f->formals->count != 1)
             {
               lval_del(a);
+              lval_del(f);
               return lval_err("Function format invalid. "
                               "Symbol '&' not fallowed by a single symbol.");
             }
@@ -611,7 +2739,7 @@ lval* lval_call (lenv* e, lval* f, lval* a)
       // bind this values to the function env
       // Old values of sybmols are replaced by new ones (passed as
       // args to func)
-      lenv_put(f->env, sym, val);
+      lenv_bind(f->env, sym, val);
       // Delete symbol and value
       lval_del(sym);
       lval_del(val);
@@ -623,61 +2751,584 @@ lval* lval_call (lenv* e, lval* f, lval* a)
     {
       if (f->formals->count != 2)
         {
-          return lval_err("Function format invalid. "
-                          "Symbol '&' not followed by single symbol.");
+          lval_del(f);
+          return lval_err("Function format invalid. "
+                          "Symbol '&' not followed by single symbol.");
+        }
+      // Pop and delete '&' symbol
+      lval_del(lval_pop(f->formals, 0));
+      // Pop next symbol 'name that represents the list of func args'
+      lval* sym = lval_pop(f->formals, 0);
+      lval* val = lval_qexpr();
+      // Bind to enviroment and delete;
+      lenv_put(f->env, sym, val);
+      lval_del(sym);
+      lval_del(val);
+    }
+  // if all formals have been bound evaluate them
+  if (f->formals->count == 0)
+    {
+      // Set enviroment parent to evaluation enviroment
+      lenv_set_par(f->env, e);
+      // Body is evaluated by the caller, so calls in tail position
+      // don't grow the C stack
+      lval* result = lval_tail(f->env, lval_copy(f->body));
+      lval_del(f);
+      return result;
+    }
+  else
+    {
+      // return partialy evaluated func
+      return f;
+    }
+}
+
+// Value of a leaf of the syntax tree, NULL for lists
+lval* lval_read_atom(mpc_ast_t* t)
+{
+  // If symbol or number return conversion to that type
+  if (strstr(t->tag, "number")) { return lval_read_num(t); }
+  if (strstr(t->tag, "boolean")) { return lval_read_boolean(t->contents); }
+  if (strstr(t->tag, "string")) { return lval_read_str(t); }
+  if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
+  return NULL;
+}
+
+// Empty list of a node that is not a leaf
+lval* lval_read_list(mpc_ast_t* t)
+{
+  // If root (>) or sexpr then create empty list
+  lval* x = NULL;
+  if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); }
+  if (strstr(t->tag, "sexpr")) { x = lval_sexpr(); }
+  if (strstr(t->tag, "qexpr")) { x = lval_qexpr(); }
+  return x;
+}
+
+// Whether child t is only syntax
+int lval_read_skip(mpc_ast_t* t)
+{
+  return strcmp(t->contents, "(") == 0 || strcmp(t->contents, ")") == 0
+    || strcmp(t->contents, "{") == 0 || strcmp(t->contents, "}") == 0
+    || strcmp(t->tag, "regex") == 0 || strstr(t->tag, "comment");
+}
+
+// Node of the syntax tree being read and the list it is read into
+typedef struct lval_read_frame
+{
+  mpc_ast_t* t;
+  // Next child to read
+  int i;
+  lval* x;
+} lval_read_frame;
+
+// Lists being read are kept on an explicit stack, so nesting is bounded
+// by memory and not by the C stack. Each list is added to its parent as
+// it is opened, the collector finds all of them from the outermost one.
+lval* lval_read(mpc_ast_t* t)
+{
+  lval* x = lval_read_atom(t);
+  if (x) { return x; }
+
+  x = lval_read_list(t);
+  int n = 0;
+  int size = 16;
+  lval_read_frame* stack = malloc(sizeof(lval_read_frame) * size);
+  stack[n++] = (lval_read_frame) { t, 0, x };
+  while (n)
+    {
+      lval_read_frame* f = &stack[n - 1];
+      if (f->i == f->t->children_num)
+        {
+          n--;
+          continue;
+        }
+      mpc_ast_t* c = f->t->children[f->i++];
+      if (lval_read_skip(c)) { continue; }
+
+      lval* y = lval_read_atom(c);
+      if (y)
+        {
+          lval_add(f->x, y);
+          continue;
+        }
+      y = lval_read_list(c);
+      lval_add(f->x, y);
+      if (n == size)
+        {
+          size *= 2;
+          stack = realloc(stack, sizeof(lval_read_frame) * size);
+        }
+      stack[n++] = (lval_read_frame) { c, 0, y };
+    }
+  free(stack);
+  return x;
+}
+
+// Reads whole file with the mpc grammar, used by --reader=mpc
+lval* lval_read_contents(char* filename, char** error)
+{
+  mpc_result_t r;
+  if (!mpc_parse_contents(filename, Lispy, &r))
+    {
+      *error = mpc_err_string(r.error);
+      mpc_err_delete(r.error);
+      return NULL;
+    }
+  lval* x = lval_read(r.output);
+  mpc_ast_delete(r.output);
+  return x;
+}
+
+
+// Native reader. Goes over the source once and builds lvals directly,
+// without syntax tree. It accepts the same language as the grammar in
+// main: every token is the longest match of the first rule that matches,
+// so '12ab' is a number followed by symbol just like there.
+typedef struct lreader
+{
+  char* name;
+  char* start;
+  char* pos;
+  char* end;
+  // Message of the syntax error, if any
+  char* error;
+  // Line and column of start, for input read in parts
+  int line;
+  long column;
+} lreader;
+
+int lread_is_space(char c)
+{
+  return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\f'
+    || c == '\v';
+}
+
+int lread_is_digit(char c)
+{
+  return c >= '0' && c <= '9';
+}
+
+int lread_is_symbol(char c)
+{
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || lread_is_digit(c)
+    || c == '_' || c == '+' || c == '-' || c == '*' || c == '/' || c == '\\'
+    || c == '=' || c == '<' || c == '>' || c == '!' || c == '&';
+}
+
+void lread_error(lreader* r, char* msg)
+{
+  // Position is only needed here, so it is not tracked while reading
+  int line = r->line;
+  long column = r->column;
+  for (char* s = r->start; s < r->pos; s++)
+    {
+      if (*s == '\n') { line++; column = 0; }
+      else { column++; }
+    }
+
+  r->error = malloc(512);
+  if (r->pos < r->end)
+    {
+      snprintf(r->error, 512, "%s:%i:%li: error: unexpected '%c', %s",
+               r->name, line, column + 1, *r->pos, msg);
+    }
+  else
+    {
+      snprintf(r->error, 512, "%s:%i:%li: error: unexpected end of input, %s",
+               r->name, line, column + 1, msg);
+    }
+}
+
+// Skips whitespace and comments
+void lread_space(lreader* r)
+{
+  while (r->pos < r->end)
+    {
+      if (lread_is_space(*r->pos)) { r->pos++; }
+      else if (*r->pos == ';')
+        {
+          while (r->pos < r->end && *r->pos != '\n' && *r->pos != '\r')
+            {
+              r->pos++;
+            }
+        }
+      else { break; }
+    }
+}
+
+lval* lread_num(lreader* r)
+{
+  int neg = *r->pos == '-';
+  if (neg) { r->pos++; }
+
+  // Same range as strtol, longer numbers are read as big
+  char* start = r->pos;
+  unsigned long limit = neg ? (unsigned long) LONG_MAX + 1 : LONG_MAX;
+  unsigned long x = 0;
+  int range = 1;
+  for (; r->pos < r->end && lread_is_digit(*r->pos); r->pos++)
+    {
+      unsigned long d = *r->pos - '0';
+      if (x > (limit - d) / 10) { range = 0; }
+      else { x = x * 10 + d; }
+    }
+
+  // Double needs digits after the point, the exponent is optional
+  if (r->end - r->pos > 1 && r->pos[0] == '.' && lread_is_digit(r->pos[1]))
+    {
+      r->pos++;
+      while (r->pos < r->end && lread_is_digit(*r->pos)) { r->pos++; }
+      char* e = r->pos;
+      if (e < r->end && (*e == 'e' || *e == 'E'))
+        {
+          e++;
+          if (e < r->end && (*e == '-' || *e == '+')) { e++; }
+          if (e < r->end && lread_is_digit(*e))
+            {
+              while (e < r->end && lread_is_digit(*e)) { e++; }
+              r->pos = e;
+            }
+        }
+      return ldbl_read(start - neg, r->pos - start + neg);
+    }
+  if (!range) { return lbig_read(start, r->pos - start, neg); }
+  return lval_num(neg ? (long) (0 - x) : (long) x);
+}
+
+lval* lread_str(lreader* r)
+{
+  char* s = ++r->pos;
+  while (s < r->end && *s != '"')
+    {
+      s += *s == '\\' && s + 1 < r->end ? 2 : 1;
+    }
+  if (s >= r->end)
+    {
+      r->pos = r->end;
+      lread_error(r, "expected '\"'");
+      return NULL;
+    }
+
+  // Copied straight from the source, escapes are replaced in place as
+  // they never get longer
+  size_t n = s - r->pos;
+  lval* x = lval_str_len(r->pos, n);
+  r->pos = s + 1;
+  if (!memchr(x->str, '\\', n)) { return x; }
+
+  // Escapes of the mpc unescape function, \0 leaves nothing and
+  // unknown ones are kept as they are
+  char* b = x->str;
+  for (char* c = x->str; c < x->str + n; c++)
+    {
+      if (*c != '\\') { *b++ = *c; continue; }
+      switch (c[1])
+        {
+        case 'a': *b++ = '\a'; break;
+        case 'b': *b++ = '\b'; break;
+        case 'f': *b++ = '\f'; break;
+        case 'n': *b++ = '\n'; break;
+        case 'r': *b++ = '\r'; break;
+        case 't': *b++ = '\t'; break;
+        case 'v': *b++ = '\v'; break;
+        case '\\': *b++ = '\\'; break;
+        case '\'': *b++ = '\''; break;
+        case '"': *b++ = '"'; break;
+        case '0': break;
+        default: *b++ = '\\'; *b++ = c[1]; break;
+        }
+      c++;
+    }
+  *b = '\0';
+  return x;
+}
+
+int lread_word(lreader* r, char* w, int n)
+{
+  if (r->end - r->pos < n || memcmp(r->pos, w, n) != 0) { return 0; }
+  r->pos += n;
+  return 1;
+}
+
+// Reads expression other than list starting at r->pos, NULL on syntax
+// error
+lval* lread_atom(lreader* r)
+{
+  char c = *r->pos;
+  if (lread_is_digit(c)
+      || (c == '-' && r->pos + 1 < r->end && lread_is_digit(r->pos[1])))
+    {
+      return lread_num(r);
+    }
+  if (lread_word(r, "True", 4)) { return lval_boolean(1); }
+  if (lread_word(r, "False", 5)) { return lval_boolean(0); }
+  if (c == '"') { return lread_str(r); }
+  if (lread_is_symbol(c))
+    {
+      char* s = r->pos;
+      while (r->pos < r->end && lread_is_symbol(*r->pos)) { r->pos++; }
+      return lval_sym_len(s, r->pos - s);
+    }
+
+  lread_error(r, "expected expression");
+  return NULL;
+}
+
+// Empty list opened by the character at r->pos, NULL for anything else
+lval* lread_open(lreader* r)
+{
+  if (*r->pos == '(') { r->pos++; return lval_sexpr(); }
+  if (*r->pos == '{') { r->pos++; return lval_qexpr(); }
+  return NULL;
+}
+
+// Reads expression starting at r->pos, NULL on syntax error. Lists being
+// read are kept on an explicit stack as in lval_read.
+lval* lread_expr(lreader* r)
+{
+  lval* x = lread_open(r);
+  if (!x) { return lread_atom(r); }
+
+  int n = 0;
+  int size = 16;
+  lval** open = malloc(sizeof(lval*) * size);
+  open[n++] = x;
+  while (n)
+    {
+      lval* list = open[n - 1];
+      char close = LTYPE(list) == LVAL_SEXPR ? ')' : '}';
+      lread_space(r);
+      if (r->pos < r->end && *r->pos == close)
+        {
+          r->pos++;
+          n--;
+          continue;
+        }
+      if (r->pos == r->end)
+        {
+          lread_error(r, close == ')' ? "expected ')'" : "expected '}'");
+          break;
+        }
+
+      lval* y = lread_open(r);
+      if (y)
+        {
+          lval_add(list, y);
+          if (n == size)
+            {
+              size *= 2;
+              open = realloc(open, sizeof(lval*) * size);
+            }
+          open[n++] = y;
+          continue;
+        }
+      y = lread_atom(r);
+      if (!y) { break; }
+      lval_add(list, y);
+    }
+  free(open);
+  if (n)
+    {
+      lval_del(x);
+      return NULL;
+    }
+  return x;
+}
+
+// Reader of input that arrives in parts, like lines of the REPL or
+// blocks of a pipe. Each new byte is scanned once for the end of the
+// top-level form it belongs to, and the form is read with the native
+// reader once it is complete. Only the unfinished form is kept.
+enum { LSTREAM_SPACE, LSTREAM_ATOM, LSTREAM_STRING, LSTREAM_ESCAPE,
+       LSTREAM_COMMENT };
+
+typedef struct lstream
+{
+  char* name;
+  char* buffer;
+  size_t len;
+  size_t size;
+  // Read up to pos, forms are complete up to ready, scanned up to scan
+  size_t pos;
+  size_t ready;
+  size_t scan;
+  // Scanner state at scan
+  int depth;
+  int state;
+  // Whether all input was fed
+  int closed;
+  // Buffer is not owned, see lstream_borrow
+  int borrowed;
+  // Line and column of the buffer start
+  int line;
+  long column;
+} lstream;
+
+void lstream_init(lstream* s, char* name)
+{
+  memset(s, 0, sizeof(lstream));
+  s->name = name;
+  s->line = 1;
+}
+
+void lstream_free(lstream* s)
+{
+  if (!s->borrowed) { free(s->buffer); }
+}
+
+// Reads the n characters at chunk in place instead of a copy. It is all
+// of the input, chunk must outlive the stream and nothing can be fed.
+void lstream_borrow(lstream* s, char* chunk, size_t n)
+{
+  s->buffer = chunk;
+  s->len = s->size = n;
+  s->borrowed = 1;
+  s->closed = 1;
+}
+
+void lstream_feed(lstream* s, char* chunk, size_t n)
+{
+  // Read input is dropped, only its position is kept
+  if (s->pos > 0)
+    {
+      for (char* c = s->buffer; c < s->buffer + s->pos; c++)
+        {
+          if (*c == '\n') { s->line++; s->column = 0; }
+          else { s->column++; }
         }
-      // Pop and delete '&' symbol
-      lval_del(lval_pop(f->formals, 0));
-      // Pop next symbol 'name that represents the list of func args'
-      lval* sym = lval_pop(f->formals, 0);
-      lval* val = lval_qexpr();
-      // Bind to enviroment and delete;
-      lenv_put(f->env, sym, val);
-      lval_del(sym);
-      lval_del(val);
-    }
-  // if all formals have been bound evaluate them
-  if (f->formals->count == 0)
-    {
-      // Set enviroment parent to evaluation enviroment
-      f->env->par = e;
-      // Eval and return
-      return builtin_eval(f->env,
-                          lval_add(lval_sexpr(), lval_copy(f->body)));
+      memmove(s->buffer, s->buffer + s->pos, s->len - s->pos);
+      s->len -= s->pos;
+      s->ready -= s->pos;
+      s->scan -= s->pos;
+      s->pos = 0;
     }
-  else
+
+  if (n == 0) { return; }
+  if (s->len + n > s->size)
     {
-      // return partialy evaluated func
-      return lval_copy(f);
+      s->size = s->len + n > 2 * s->size ? s->len + n : 2 * s->size;
+      s->buffer = realloc(s->buffer, s->size);
     }
+  memcpy(s->buffer + s->len, chunk, n);
+  s->len += n;
 }
 
-lval* lval_read(mpc_ast_t* t)
+// No more input, an unfinished form is a syntax error
+void lstream_close(lstream* s)
 {
-  // If symbol or number return conversion to that type
-  if (strstr(t->tag, "number")) { return lval_read_num(t); }
-  if (strstr(t->tag, "boolean")) { return lval_read_boolean(t->contents); }
-  if (strstr(t->tag, "string")) { return lval_read_str(t); }
-  if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
+  s->closed = 1;
+}
 
-  // If root (>) or sexpr then create empty list
-  lval* x = NULL;
-  if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); }
-  if (strstr(t->tag, "sexpr")) { x = lval_sexpr(); }
-  if (strstr(t->tag, "qexpr")) { x = lval_qexpr(); }
+// Whether a form was started but is not complete yet
+int lstream_pending(lstream* s)
+{
+  return s->depth > 0 || s->state == LSTREAM_ATOM
+    || s->state == LSTREAM_STRING || s->state == LSTREAM_ESCAPE;
+}
 
-  for (int i = 0; i < t->children_num; i++)
+// Scans new input up to the end of the next top-level form, returns
+// whether one was found
+int lstream_scan(lstream* s)
+{
+  for (; s->scan < s->len; s->scan++)
     {
-      if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
-      if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
-      if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
-      if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
-      if (strcmp(t->children[i]->tag,  "regex") == 0) { continue; }
-      if (strstr(t->children[i]->tag,  "comment"))  { continue; }
+      char c = s->buffer[s->scan];
+      switch (s->state)
+        {
+        case LSTREAM_STRING:
+          if (c == '\\') { s->state = LSTREAM_ESCAPE; }
+          else if (c == '"')
+            {
+              s->state = LSTREAM_SPACE;
+              if (s->depth == 0)
+                {
+                  s->ready = ++s->scan;
+                  return 1;
+                }
+            }
+          continue;
+        case LSTREAM_ESCAPE:
+          s->state = LSTREAM_STRING;
+          continue;
+        case LSTREAM_COMMENT:
+          if (c == '\n' || c == '\r') { s->state = LSTREAM_SPACE; }
+          continue;
+        case LSTREAM_ATOM:
+          if (!lread_is_space(c) && !strchr(";\"(){}", c)) { continue; }
+          s->state = LSTREAM_SPACE;
+          // Token may go on in the next part, so it ends here
+          if (s->depth == 0)
+            {
+              s->ready = s->scan;
+              return 1;
+            }
+          break;
+        }
 
-      x = lval_add(x, lval_read(t->children[i]));
+      // Whitespace and comments before a form are skipped, part of them
+      // may already be dropped
+      if (s->depth == 0 && c != ';' && !lread_is_space(c))
+        {
+          s->pos = s->ready = s->scan;
+        }
+      if (c == '"') { s->state = LSTREAM_STRING; }
+      else if (c == ';') { s->state = LSTREAM_COMMENT; }
+      else if (c == '(' || c == '{') { s->depth++; }
+      else if (c == ')' || c == '}')
+        {
+          // Unmatched ones are left for the reader to report
+          if (s->depth > 0) { s->depth--; }
+          if (s->depth == 0)
+            {
+              s->ready = ++s->scan;
+              return 1;
+            }
+        }
+      else if (!lread_is_space(c)) { s->state = LSTREAM_ATOM; }
+    }
+  return 0;
+}
+
+// Next complete top-level form, NULL when more input is needed. On
+// syntax error returns NULL, sets error and drops the input fed so far.
+lval* lstream_next(lstream* s, char** error)
+{
+  *error = NULL;
+  while (1)
+    {
+      lreader r = { s->name, s->buffer, s->buffer + s->pos,
+                    s->buffer + s->ready, NULL, s->line, s->column };
+      lread_space(&r);
+      if (r.pos < r.end)
+        {
+          lval* x = lread_expr(&r);
+          s->pos = r.pos - s->buffer;
+          if (!x)
+            {
+              *error = r.error;
+              s->pos = s->ready = s->scan = s->len;
+              s->depth = 0;
+              s->state = LSTREAM_SPACE;
+            }
+          return x;
+        }
+      s->pos = s->ready;
+
+      if (lstream_scan(s)) { continue; }
+      if (s->closed && lstream_pending(s))
+        {
+          // Rest is read as it is, an unfinished form fails
+          s->ready = s->len;
+          s->depth = 0;
+          s->state = LSTREAM_SPACE;
+          continue;
+        }
+
+      // Whitespace and comments before the next form are not kept
+      if (!lstream_pending(s)) { s->pos = s->ready = s->scan; }
+      return NULL;
     }
-  return x;
 }
 
 void lval_print_str(lval* v)
@@ -696,9 +3347,12 @@ void lval_print_str(lval* v)
 // Print lval
 void lval_print(lval* v)
 {
-  switch (v->type)
+  switch (LTYPE(v))
     {
-    case LVAL_NUM: printf("%li", v->num); break;
+    case LVAL_NUM: printf("%li", LNUM(v)); break;
+    case LVAL_BIG: lbig_print(v); break;
+    case LVAL_DBL: ldbl_print(v->dbl); break;
+    case LVAL_VECTOR: lvec_print(v); break;
     case LVAL_STRING: lval_print_str(v); break;
     case LVAL_FUN:
       if (v->builtin) { printf("<builtin>"); break; }
@@ -712,20 +3366,57 @@ void lval_print(lval* v)
         }
       break;
     case LVAL_ERR: printf("Error: %s", v->err); break;
-    case LVAL_BOOL:
+    case LVAL_BOOL: printf("%s", LNUM(v) ? "True" : "False"); break;
     case LVAL_SYM: printf("%s", v->sym); break;
     case LVAL_SEXPR: lval_expr_print(v, '(', ')'); break;
     case LVAL_QEXPR: lval_expr_print(v, '{', '}'); break;
     }
 }
 
+// Values are immutable while shared, so copying is just taking a reference
 lval* lval_copy(lval* v)
 {
-  lval* x = malloc(sizeof(lval));
+  if (!LVAL_IMM(v)) { v->refs++; }
+  return v;
+}
+
+// Copy on write. Takes over one reference to v and returns a value that
+// is owned exclusively by the caller and can be mutated in place.
+// Children of the new value are shared with v. Owners of traced values
+// are not counted, so those are always copied.
+lval* lval_unshare(lval* v)
+{
+  if (LVAL_IMM(v)) { return v; }
+  if (v->refs == 1 && lgc_mode == LGC_COPY)
+    {
+      // Caller is going to mutate it, compiled code would go stale
+      if ((v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) && v->code)
+        {
+          lcode_del(v->code);
+          v->code = NULL;
+        }
+      return v;
+    }
+
+  lval* x = lgc_alloc(LGC_LVAL, sizeof(lval));
   x->type = v->type;
+  x->refs = 1;
   switch (v->type)
     {
     case LVAL_NUM: x->num = v->num; break;
+    case LVAL_DBL: x->dbl = v->dbl; break;
+    case LVAL_BIG:
+      x->neg = v->neg;
+      x->ndigits = v->ndigits;
+      x->digits = malloc(sizeof(uint32_t) * v->ndigits);
+      memcpy(x->digits, v->digits, sizeof(uint32_t) * v->ndigits);
+      break;
+    case LVAL_VECTOR:
+      x->len = v->len;
+      x->is_dbl = v->is_dbl;
+      x->longs = lalloc(LVEC_BYTES(v));
+      if (v->len) { memcpy(x->longs, v->longs, LVEC_BYTES(v)); }
+      break;
     case LVAL_FUN:
       if (v->builtin) { x->builtin = v->builtin; break; }
       else
@@ -740,29 +3431,45 @@ lval* lval_copy(lval* v)
       x->err = malloc(strlen(v->err) + 1);
       strcpy(x->err, v->err); break;
     case LVAL_SYM:
-      x->sym = malloc(strlen(v->sym) + 1);
-      strcpy(x->sym, v->sym); break;
+      x->sym = v->sym;
+      x->depth = v->depth;
+      x->slot = v->slot;
+      x->cache = v->cache;
+      x->version = v->version;
+      break;
     case LVAL_STRING:
       x->str = malloc(strlen(v->str) + 1);
       strcpy(x->str, v->str); break;
-    case LVAL_BOOL:
-      x->num = v->num; 
-      x->sym = malloc(strlen(v->sym) + 1);
-      strcpy(x->sym, v->sym);
-      break;
     case LVAL_SEXPR: 
     case LVAL_QEXPR:
       x->count = v->count;
-      x->cell = malloc(sizeof(lval*) * x->count);
+      x->cap = v->count;
+      x->start = 0;
+      x->code = NULL;
+      x->cell = lalloc(sizeof(lval*) * x->count);
       for (int i = 0; i < x->count; i++)
         {
           x->cell[i] = lval_copy(v->cell[i]);
         }
       break;
     }
+  v->refs--;
   return x;
 }
 
+// Vector is printed as [1 2 3]
+void lvec_print(lval* v)
+{
+  putchar('[');
+  for (int i = 0; i < v->len; i++)
+    {
+      if (i) { putchar(' '); }
+      if (v->is_dbl) { ldbl_print(v->dbls[i]); }
+      else { printf("%li", v->longs[i]); }
+    }
+  putchar(']');
+}
+
 void lval_println(lval* v)
 {
   lval_print(v);
@@ -798,6 +3505,22 @@ lval* builtin_print(lenv* e, lval* a)
   return lval_sexpr();
 }
 
+// Print arguments as a label followed by allocator statistics
+lval* builtin_alloc_stats(lenv* e, lval* a)
+{
+  lval_del(builtin_print(e, a));
+  lalloc_print_stats();
+  return lval_sexpr();
+}
+
+// Print arguments as a label followed by collector statistics
+lval* builtin_gc_stats(lenv* e, lval* a)
+{
+  lval_del(builtin_print(e, a));
+  lgc_print_stats();
+  return lval_sexpr();
+}
+
 lval* builtin_error(lenv* e, lval* a)
 {
   LASSERT_NUM("error", a, 1);
@@ -810,44 +3533,132 @@ lval* builtin_error(lenv* e, lval* a)
   return err;
 }
 
+enum { LREAD_BLOCK = 64 * 1024 };
+
+// Evaluates top-level form of a file, only errors are printed
+void lval_eval_top(lenv* e, lval* x)
+{
+  lalloc_arena_begin();
+  lval* y = lval_eval(e, x);
+  if (LTYPE(y) == LVAL_ERR) { lval_println(y); }
+  lval_del(y);
+  lalloc_arena_end();
+}
+
+#ifndef _WIN32
+// Evaluates a regular file from a mapping, the stream reads it in place.
+// Pages already read are given back a block at a time, so memory stays
+// bounded as when reading blocks. Returns -1 when f can't be mapped,
+// otherwise the same as lread_eval.
+int lread_eval_map(lenv* e, FILE* f, char* name, char** error)
+{
+  int fd = fileno(f);
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0
+      || lseek(fd, 0, SEEK_CUR) != 0)
+    {
+      return -1;
+    }
+  char* m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (m == MAP_FAILED) { return -1; }
+  madvise(m, st.st_size, MADV_SEQUENTIAL);
+
+  lstream s;
+  lstream_init(&s, name);
+  lstream_borrow(&s, m, st.st_size);
+  *error = NULL;
+  size_t dropped = 0;
+  lval* x;
+  while ((x = lstream_next(&s, error)))
+    {
+      lval_eval_top(e, x);
+      size_t done = s.pos & ~(size_t) (LREAD_BLOCK - 1);
+      if (done > dropped)
+        {
+          madvise(m + dropped, done - dropped, MADV_DONTNEED);
+          dropped = done;
+        }
+    }
+  lstream_free(&s);
+  munmap(m, st.st_size);
+  return *error == NULL;
+}
+#endif
+
+// Reads f a block at a time and evaluates each top-level form as soon as
+// it is complete, so memory is bounded by the largest form instead of the
+// whole input. On syntax error returns 0 and sets error, the forms before
+// it are already evaluated.
+int lread_eval(lenv* e, FILE* f, char* name, char** error)
+{
+#ifndef _WIN32
+  int mapped = lread_eval_map(e, f, name, error);
+  if (mapped >= 0) { return mapped; }
+#endif
+
+  lstream s;
+  lstream_init(&s, name);
+  char* block = malloc(LREAD_BLOCK);
+  *error = NULL;
+  while (1)
+    {
+      // Output of the forms so far is not held back while waiting
+      fflush(stdout);
+#ifdef _WIN32
+      long got = (long) fread(block, 1, LREAD_BLOCK, f);
+#else
+      // Takes what is there, a form from a pipe is evaluated on arrival
+      long got = (long) read(fileno(f), block, LREAD_BLOCK);
+      if (got < 0 && errno == EINTR) { continue; }
+#endif
+      if (got > 0) { lstream_feed(&s, block, got); }
+      else { lstream_close(&s); }
+
+      lval* x;
+      while ((x = lstream_next(&s, error))) { lval_eval_top(e, x); }
+      if (got <= 0 || *error) { break; }
+    }
+  free(block);
+  lstream_free(&s);
+  return *error == NULL;
+}
+
 lval* builtin_load(lenv* e, lval* a)
 {
   LASSERT_NUM("load", a, 1);
   LASSERT_TYPE("load", a, 0, LVAL_STRING);
 
-  // Parser file given by string name
-  mpc_result_t r;
-  if (mpc_parse_contents(a->cell[0]->str, Lispy, &r))
+  char* err_msg = NULL;
+  if (lval_reader == LREADER_NATIVE)
     {
-      // Read contents
-      lval* expr = lval_read(r.output);
-      mpc_ast_delete(r.output);
-
-      // Eval each expression
-      while(expr->count)
+      FILE* f = fopen(a->cell[0]->str, "rb");
+      if (!f)
         {
-          lval* x =  lval_eval(e, lval_pop(expr, 0));
-          // If eval leads to err print it
-          if (x->type == LVAL_ERR)
-            {
-              lval_println(x);
-            }
-          lval_del(x);
+          err_msg = malloc(512);
+          snprintf(err_msg, 512, "%s: error: unable to open file",
+                   a->cell[0]->str);
+        }
+      else
+        {
+          lread_eval(e, f, a->cell[0]->str, &err_msg);
+          fclose(f);
         }
-
-      // delete expr and args
-      lval_del(expr);
-      lval_del(a);
-
-      // return empty list
-      return lval_sexpr();
     }
   else
     {
-      // Get parse error as string
-      char* err_msg = mpc_err_string(r.error);
-      mpc_err_delete(r.error);
-      // Create new error message using it
+      // Parser file given by string name
+      lval* expr = lval_read_contents(a->cell[0]->str, &err_msg);
+      if (expr)
+        {
+          // Eval each expression
+          while (expr->count) { lval_eval_top(e, lval_pop(expr, 0)); }
+          lval_del(expr);
+        }
+    }
+
+  if (err_msg)
+    {
+      // Create new error message using parse error
       lval* err = lval_err("Could not load library %s", err_msg);
       free(err_msg);
       lval_del(a);
@@ -855,6 +3666,107 @@ lval* builtin_load(lenv* e, lval* a)
       // Clean up and return error
       return err;
     }
+
+  // delete args and return empty list
+  lval_del(a);
+  return lval_sexpr();
+}
+
+// Frames of the lambdas enclosing a body, innermost first
+typedef struct lscope
+{
+  lenv* frame;
+  struct lscope* outer;
+} lscope;
+
+lval* lval_resolve_cell(lval* v, int i, lscope* s);
+
+// Frame with formals bound the same way lval_call binds them
+lenv* lscope_frame(lval* formals)
+{
+  lenv* f = lenv_new_frame(formals->count);
+  for (int i = 0; i < formals->count; i++)
+    {
+      if (strcmp(formals->cell[i]->sym, "&") == 0) { continue; }
+      lenv_put(f, formals->cell[i], formals->cell[i]);
+    }
+  return f;
+}
+
+int lval_is_lambda_expr(lval* v)
+{
+  if (v->count != 3
+      || LTYPE(v->cell[0]) != LVAL_SYM || strcmp(v->cell[0]->sym, "\\") != 0
+      || LTYPE(v->cell[1]) != LVAL_QEXPR || LTYPE(v->cell[2]) != LVAL_QEXPR)
+    {
+      return 0;
+    }
+  for (int i = 0; i < v->cell[1]->count; i++)
+    {
+      if (LTYPE(v->cell[1]->cell[i]) != LVAL_SYM) { return 0; }
+    }
+  return 1;
+}
+
+// Annotate symbols of a lambda body bound by the formals of enclosing
+// lambdas with their frame depth and slot. Takes over v, shared values
+// are copied on write so closures sharing a body keep their own hints.
+lval* lval_resolve(lval* v, lscope* s)
+{
+  switch (LTYPE(v))
+    {
+    case LVAL_SYM:
+      {
+        int depth = 0;
+        for (; s; s = s->outer, depth++)
+          {
+            lentry* slot = lenv_slot(s->frame, v->sym);
+            if (slot->sym)
+              {
+                if (v->depth == depth && v->slot == slot - s->frame->slots)
+                  {
+                    return v;
+                  }
+                v = lval_unshare(v);
+                v->depth = depth;
+                v->slot = slot - s->frame->slots;
+                return v;
+              }
+          }
+      }
+      break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      // Nested lambda opens a new frame
+      if (lval_is_lambda_expr(v))
+        {
+          lscope inner = { lscope_frame(v->cell[1]), s };
+          v = lval_resolve_cell(v, 2, &inner);
+          lenv_del(inner.frame);
+          break;
+        }
+      for (int i = 0; i < v->count; i++)
+        {
+          v = lval_resolve_cell(v, i, s);
+        }
+      break;
+    }
+  return v;
+}
+
+// Resolve cell i of v, v is unshared only when a hint below it changes
+lval* lval_resolve_cell(lval* v, int i, lscope* s)
+{
+  lval* c = lval_resolve(lval_copy(v->cell[i]), s);
+  if (c == v->cell[i])
+    {
+      lval_del(c);
+      return v;
+    }
+  v = lval_unshare(v);
+  lval_del(v->cell[i]);
+  v->cell[i] = c;
+  return v;
 }
 
 lval* builtin_lambda(lenv* e, lval* a)
@@ -866,15 +3778,21 @@ lval* builtin_lambda(lenv* e, lval* a)
   /* Check first Q-Expression contains only Symbols */
   for (int i = 0; i < a->cell[0]->count; i++)
     {
-    LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
+    LASSERT(a, (LTYPE(a->cell[0]->cell[i]) == LVAL_SYM),
       "Cannot define non-symbol. Got %s, Expected %s.",
-      ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+      ltype_name(LTYPE(a->cell[0]->cell[i])), ltype_name(LVAL_SYM));
     }
 
   lval* formals = lval_pop(a, 0);
   lval* body = lval_pop(a, 0);
   lval_del(a);
 
+  // Formals get their own slots, lval_call binds them by index
+  lscope scope = { lscope_frame(formals), NULL };
+  formals = lval_resolve(formals, &scope);
+  body = lval_resolve(body, &scope);
+  lenv_del(scope.frame);
+
   return lval_lambda(formals, body);
 }
 
@@ -885,94 +3803,421 @@ lval* builtin_if(lenv* e, lval* a)
   LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
   LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
 
-  // Mark both expressions evaluable
-  lval *x;
-  a->cell[1]->type = LVAL_SEXPR;
-  a->cell[2]->type = LVAL_SEXPR;
+  // Pick branch, it is evaluated in tail position
+  lval* x = lval_tail(e, lval_pop(a, LNUM(a->cell[0]) ? 1 : 2));
+
+  // Delete argument list and return
+  lval_del(a);
+  return x;
+}
+
+
+// Arithmetic and logic builtins fold over the argument cells in place,
+// each with its operator fixed. Numbers stored in the pointer need no
+// type lookup and no deleting, only boxed numbers take the slow branch.
+// Big numbers, doubles and overflow of long leave for lval_fold_big.
+
+// Argument list is not all numbers
+lval* lval_fold_err(lval* a)
+{
+  lval_del(a);
+  return lval_err("Cannot operate on non-number");
+}
+
+// Frees the arguments of a fold and returns its result x, unless one was
+// boxed the cells are dropped without visiting them again
+lval* lval_fold_del(lval* a, int boxed, lval* x)
+{
+  if (!boxed && a->refs == 1) { a->count = 0; }
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_add(lenv* e, lval* a)
+{
+  if (a->count == 1 && LVAL_SEQ(a->cell[0]))
+    {
+      return lval_reduce(e, a, LREDUCE_ADD);
+    }
+  long acc = 0;
+  int boxed = 0;
+  for (int i = 0; i < a->count; i++)
+    {
+      lval* y = a->cell[i];
+      if (!LVAL_IMM(y))
+        {
+          if (y->type != LVAL_NUM) { return lval_fold_big(a, lval_num(0), lbig_add); }
+          boxed = 1;
+        }
+      if (LADD_OVERFLOW(acc, LNUM(y), &acc))
+        {
+          return lval_fold_big(a, lval_num(0), lbig_add);
+        }
+    }
+  return lval_fold_del(a, boxed, lval_num(acc));
+}
+
+lval* builtin_sub(lenv* e, lval* a)
+{
+  LASSERT(a, a->count > 0, "Function '-' passed no arguments.");
+  // With one argument perform unary negation
+  lval* init = a->count == 1 ? lval_num(0) : NULL;
+  long acc = 0;
+  int boxed = 0;
+  for (int i = 0; i < a->count; i++)
+    {
+      lval* y = a->cell[i];
+      if (!LVAL_IMM(y))
+        {
+          if (y->type != LVAL_NUM) { return lval_fold_big(a, init, lbig_sub); }
+          boxed = 1;
+        }
+      if (i == 0 && !init) { acc = LNUM(y); }
+      else if (LSUB_OVERFLOW(acc, LNUM(y), &acc))
+        {
+          return lval_fold_big(a, init, lbig_sub);
+        }
+    }
+  return lval_fold_del(a, boxed, lval_num(acc));
+}
+
+lval* builtin_mul(lenv* e, lval* a)
+{
+  if (a->count == 1 && LVAL_SEQ(a->cell[0]))
+    {
+      return lval_reduce(e, a, LREDUCE_MUL);
+    }
+  long acc = 1;
+  int boxed = 0;
+  for (int i = 0; i < a->count; i++)
+    {
+      lval* y = a->cell[i];
+      if (!LVAL_IMM(y))
+        {
+          if (y->type != LVAL_NUM) { return lval_fold_big(a, lval_num(1), lbig_mul); }
+          boxed = 1;
+        }
+      if (LMUL_OVERFLOW(acc, LNUM(y), &acc))
+        {
+          return lval_fold_big(a, lval_num(1), lbig_mul);
+        }
+    }
+  return lval_fold_del(a, boxed, lval_num(acc));
+}
+
+lval* builtin_div(lenv* e, lval* a)
+{
+  LASSERT(a, a->count > 0, "Function '/' passed no arguments.");
+  long acc = 0;
+  int boxed = 0;
+  for (int i = 0; i < a->count; i++)
+    {
+      lval* y = a->cell[i];
+      if (!LVAL_IMM(y))
+        {
+          if (y->type != LVAL_NUM) { return lval_fold_big(a, NULL, lbig_div); }
+          boxed = 1;
+        }
+      if (i == 0) { acc = LNUM(y); continue; }
+      if (LNUM(y) == 0)
+        {
+          lval_del(a);
+          return lval_err("Division by zero!");
+        }
+      // Only LONG_MIN / -1 is out of range
+      if (LNUM(y) == -1 && acc == LONG_MIN)
+        {
+          return lval_fold_big(a, NULL, lbig_div);
+        }
+      acc /= LNUM(y);
+    }
+  return lval_fold_del(a, boxed, lval_num(acc));
+}
+
+// Smallest or largest of the arguments, which keeps its type
+lval* lval_fold_pick(lval* a, char* func, int max)
+{
+  LASSERT(a, a->count > 0, "Function '%s' passed no arguments.", func);
+  int best = 0;
+  for (int i = 0; i < a->count; i++)
+    {
+      lval* y = a->cell[i];
+      if (!LVAL_NUMERIC(y) && LTYPE(y) != LVAL_BOOL) { return lval_fold_err(a); }
+      int c = LNUM_CMP(y, a->cell[best]);
+      if (max ? c > 0 : c < 0) { best = i; }
+    }
+  return lval_fold_del(a, 1, lval_copy(a->cell[best]));
+}
+
+lval* builtin_min(lenv* e, lval* a)
+{
+  if (a->count == 1 && LVAL_SEQ(a->cell[0]))
+    {
+      return lval_reduce(e, a, LREDUCE_MIN);
+    }
+  return lval_fold_pick(a, "min", 0);
+}
+
+lval* builtin_max(lenv* e, lval* a)
+{
+  if (a->count == 1 && LVAL_SEQ(a->cell[0]))
+    {
+      return lval_reduce(e, a, LREDUCE_MAX);
+    }
+  return lval_fold_pick(a, "max", 1);
+}
 
-  if (a->cell[0]->num)
+// The only argument is a Q-Expression or vector, its elements are
+// reduced by the kernels or else folded as if they were passed one by one
+lval* lval_reduce(lenv* e, lval* a, int op)
+{
+  lval* q = lval_take(a, 0);
+  if (LTYPE(q) == LVAL_VECTOR) { return lvec_reduce(q, op); }
+  lval* x = lreduce(q, op);
+  if (x)
     {
-      // if condition is true evaluate first expression
-      x = lval_eval(e, lval_pop(a, 1)); 
+      lval_del(q);
+      return x;
     }
-  else
+  switch (op)
     {
-      x = lval_eval(e, lval_pop(a, 2)); 
+    case LREDUCE_ADD: return builtin_add(e, q);
+    case LREDUCE_MUL: return builtin_mul(e, q);
+    case LREDUCE_MIN: return lval_fold_pick(q, "min", 0);
+    default: return lval_fold_pick(q, "max", 1);
     }
+}
 
-  // Delete argument list and return
+lval* builtin_sum(lenv* e, lval* a)
+{
+  LASSERT_NUM("sum", a, 1);
+  LASSERT_SEQ("sum", a, 0);
+  return lval_reduce(e, a, LREDUCE_ADD);
+}
+
+lval* builtin_dot(lenv* e, lval* a)
+{
+  LASSERT_NUM("dot", a, 2);
+  LASSERT_TYPE("dot", a, 0, LVAL_VECTOR);
+  LASSERT_TYPE("dot", a, 1, LVAL_VECTOR);
+  LASSERT(a, a->cell[0]->len == a->cell[1]->len,
+          "Vector lengths differ. Got %i and %i.",
+          a->cell[0]->len, a->cell[1]->len);
+
+  lval* x = lvec_dot(a->cell[0], a->cell[1]);
   lval_del(a);
   return x;
 }
 
-
-lval* builtin_op(lenv* e, lval* a, char* op)
+// Vector of the numbers of a Q-Expression, of doubles if there is one
+lval* builtin_vector(lenv* e, lval* a)
 {
-  // Ensure all arguments are number
-  for (int i = 0; i < a->count; i++)
+  LASSERT_NUM("vector", a, 1);
+  LASSERT_TYPE("vector", a, 0, LVAL_QEXPR);
+
+  lval* q = a->cell[0];
+  int dbl = 0;
+  for (int i = 0; i < q->count; i++)
     {
-      if (a->cell[i]->type != LVAL_NUM && a->cell[i]->type != LVAL_BOOL)
-        {
-          lval_del(a);
-          return lval_err("Cannot operate on non-number");
-        }
+      int t = LTYPE(q->cell[i]);
+      LASSERT(a, t != LVAL_BIG, "Function 'vector' passed number out of range.");
+      LASSERT(a, t == LVAL_NUM || t == LVAL_DBL,
+              "Function 'vector' passed incorrect element. "
+              "Got %s, Exptected %s",
+              ltype_name(t), ltype_name(LVAL_NUM));
+      dbl |= t == LVAL_DBL;
     }
 
-  // Pop the first element
-  lval* x = lval_pop(a, 0);
-  if (x->type == LVAL_BOOL)
+  lval* v = lval_vector(q->count, dbl);
+  for (int i = 0; i < q->count; i++)
     {
-      x->type = LVAL_NUM;
+      if (dbl) { v->dbls[i] = lval_to_dbl(q->cell[i]); }
+      else { v->longs[i] = LNUM(q->cell[i]); }
     }
+  lval_del(a);
+  return v;
+}
 
-  // If no arguments and sub then perform unary negation
-  if ((strcmp(op, "-") == 0) && a->count == 0)
+// Arguments [start] end [step] of range functions, numbers from start
+// up to but not including end, with one argument it starts at 0.
+// Gives the count of them in n or returns an error, takes over a.
+lval* lrange_args(lval* a, char* func, long* start, long* step, int* n)
+{
+  LASSERT(a, a->count >= 1 && a->count <= 3,
+          "Function '%s' passed %i arguments, Expected 1 to 3.",
+          func, a->count);
+  for (int i = 0; i < a->count; i++)
     {
-      x->num = -x->num;
+      LASSERT_TYPE(func, a, i, LVAL_NUM);
     }
 
-  while (a->count > 0)
+  *start = a->count > 1 ? LNUM(a->cell[0]) : 0;
+  long end = LNUM(a->cell[a->count > 1]);
+  *step = a->count > 2 ? LNUM(a->cell[2]) : 1;
+  LASSERT(a, *step != 0, "Function '%s' passed step 0.", func);
+  lval_del(a);
+
+  // Count in unsigned so wide ranges don't overflow
+  unsigned long span = *step > 0
+    ? (end > *start ? (unsigned long) end - *start : 0)
+    : (*start > end ? (unsigned long) *start - end : 0);
+  unsigned long by = *step > 0 ? (unsigned long) *step : 0 - (unsigned long) *step;
+  unsigned long count = span ? (span - 1) / by + 1 : 0;
+  if (count > INT_MAX) { return lval_err("Range of %lu elements is too long.", count); }
+  *n = (int) count;
+  return NULL;
+}
+
+// Element i of a range, in unsigned as it may wrap on the way
+#define LRANGE_AT(start, step, i)                                       \
+  ((long) ((unsigned long) (start) + (unsigned long) (step) * (i)))
+
+lval* builtin_range(lenv* e, lval* a)
+{
+  long start, step;
+  int n;
+  lval* err = lrange_args(a, "range", &start, &step, &n);
+  if (err) { return err; }
+
+  lval* q = lval_qexpr();
+  lval_reserve(q, n);
+  for (int i = 0; i < n; i++)
     {
-      lval* y = lval_pop(a, 0);
-    
-      if (strcmp(op, "+") == 0) { x->num += y->num; }
-      else if (strcmp(op, "-") == 0) { x->num -= y->num; }
-      else if (strcmp(op, "*") == 0) { x->num *= y->num; }
-      else  if (strcmp(op, "/") == 0)
-        {
-          if (y->num == 0)
-            {
-              lval_del(x); lval_del(y);
-              x = lval_err("Division by zero!");
-              break;
-            }
-          x->num /= y->num;
-        }
-      lval_del(y);
+      q->cell[q->count++] = lval_num(LRANGE_AT(start, step, i));
     }
-  lval_del(a);
-  return x;
+  return q;
 }
 
-lval* builtin_add(lenv* e, lval* a)
+lval* builtin_vector_range(lenv* e, lval* a)
 {
+  long start, step;
+  int n;
+  lval* err = lrange_args(a, "vector-range", &start, &step, &n);
+  if (err) { return err; }
 
-  return builtin_op(e, a, "+");
+  lval* v = lval_vector(n, 0);
+  for (int i = 0; i < n; i++) { v->longs[i] = LRANGE_AT(start, step, i); }
+  return v;
 }
 
-lval* builtin_sub(lenv* e, lval* a)
+// Q-Expression of the elements of a vector
+lval* builtin_vector_list(lenv* e, lval* a)
 {
-    return builtin_op(e, a, "-");
+  LASSERT_NUM("vector-list", a, 1);
+  LASSERT_TYPE("vector-list", a, 0, LVAL_VECTOR);
+
+  lval* v = lval_take(a, 0);
+  lval* q = lval_qexpr();
+  lval_reserve(q, v->len);
+  for (int i = 0; i < v->len; i++) { lval_add(q, lvec_get(v, i)); }
+  lval_del(v);
+  return q;
 }
 
-lval* builtin_mul(lenv* e, lval* a)
+// Result of calling f with the only argument x, which it takes over
+lval* lval_call1(lenv* e, lval* f, lval* x)
 {
-    return builtin_op(e, a, "*");
+  return lval_force(lval_call(e, f, lval_add(lval_sexpr(), x)));
 }
 
-lval* builtin_div(lenv* e, lval* a)
+// Map of a vector is a vector again, of doubles once f returns one
+lval* lvec_map(lenv* e, lval* f, lval* v)
+{
+  lval* r = lval_vector(v->len, v->is_dbl);
+  for (int i = 0; i < v->len; i++)
+    {
+      lval* y = lval_call1(e, f, lvec_get(v, i));
+      if (LTYPE(y) != LVAL_NUM && LTYPE(y) != LVAL_DBL)
+        {
+          lval* err = LTYPE(y) == LVAL_ERR ? y
+            : lval_err("Function 'map' got %s for vector, Expected %s",
+                       ltype_name(LTYPE(y)), ltype_name(LVAL_NUM));
+          if (err != y) { lval_del(y); }
+          lval_del(r);
+          return err;
+        }
+      if (LTYPE(y) == LVAL_DBL && !r->is_dbl) { lvec_to_dbl(r, i); }
+      if (r->is_dbl) { r->dbls[i] = lval_to_dbl(y); }
+      else { r->longs[i] = LNUM(y); }
+      lval_del(y);
+    }
+  return r;
+}
+
+lval* builtin_map(lenv* e, lval* a)
+{
+  LASSERT_EACH("map", a);
+
+  lval* f = lval_pop(a, 0);
+  lval* q = lval_take(a, 0);
+  lval* r;
+  if (LTYPE(q) == LVAL_VECTOR) { r = lvec_map(e, f, q); }
+  else
+    {
+      r = lval_qexpr();
+      lval_reserve(r, q->count);
+      for (int i = 0; i < q->count; i++)
+        {
+          lval* y = lval_call1(e, f, lval_copy(q->cell[i]));
+          if (LTYPE(y) == LVAL_ERR)
+            {
+              lval_del(r);
+              r = y;
+              break;
+            }
+          lval_add(r, y);
+        }
+    }
+  lval_del(f);
+  lval_del(q);
+  return r;
+}
+
+// Elements for which f returns true
+lval* builtin_filter(lenv* e, lval* a)
 {
-    return builtin_op(e, a, "/");
+  LASSERT_EACH("filter", a);
+
+  lval* f = lval_pop(a, 0);
+  lval* q = lval_take(a, 0);
+  int vec = LTYPE(q) == LVAL_VECTOR;
+  int n = vec ? q->len : q->count;
+  lval* r = vec ? lval_vector(n, q->is_dbl) : lval_qexpr();
+  int k = 0;
+  for (int i = 0; i < n; i++)
+    {
+      lval* x = vec ? lvec_get(q, i) : lval_copy(q->cell[i]);
+      lval* y = lval_call1(e, f, lval_copy(x));
+      if (LTYPE(y) != LVAL_NUM && LTYPE(y) != LVAL_BOOL)
+        {
+          lval* err = LTYPE(y) == LVAL_ERR ? y
+            : lval_err("Function 'filter' got %s, Expected %s",
+                       ltype_name(LTYPE(y)), ltype_name(LVAL_BOOL));
+          if (err != y) { lval_del(y); }
+          lval_del(x);
+          lval_del(r);
+          r = err;
+          break;
+        }
+      if (LNUM(y))
+        {
+          if (!vec) { lval_add(r, lval_copy(x)); }
+          else if (q->is_dbl) { r->dbls[k++] = q->dbls[i]; }
+          else { r->longs[k++] = q->longs[i]; }
+        }
+      lval_del(x);
+      lval_del(y);
+    }
+  if (vec && LTYPE(r) == LVAL_VECTOR)
+    {
+      // Give back the room of the dropped elements
+      size_t size = LVEC_BYTES(r);
+      r->len = k;
+      r->longs = lrealloc(r->longs, size, LVEC_BYTES(r));
+    }
+  lval_del(f);
+  lval_del(q);
+  return r;
 }
 
 lval* builtin_def(lenv* e, lval* a)
@@ -991,10 +4236,10 @@ lval* builtin_var(lenv* e, lval* a, char* func)
   lval* syms = a->cell[0];
   for (int i = 0; i < syms->count; i++)
     {
-      LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
+      LASSERT(a, (LTYPE(syms->cell[i]) == LVAL_SYM),
               "Function '%s' cannot define non-symbol. "
               "Got %s, Expected %s.", func, 
-              ltype_name(syms->cell[i]->type),
+              ltype_name(LTYPE(syms->cell[i])),
               ltype_name(LVAL_SYM));
     }
 
@@ -1012,7 +4257,7 @@ lval* builtin_var(lenv* e, lval* a, char* func)
           lenv_def(e, syms->cell[i], a->cell[i+1]);
         }
       // '=' symbol will put it locally
-      else if (strcpy(func, "="))
+      else if (strcmp(func, "=") == 0)
         {
           lenv_put(e, syms->cell[i], a->cell[i+1]);
         }
@@ -1023,307 +4268,1050 @@ lval* builtin_var(lenv* e, lval* a, char* func)
 
 lval* builtin_gt(lenv* e, lval* a)
 {
-  return builtin_ord(e, a, ">");
+  LASSERT_ORD(">", a);
+  int r = LNUM_CMP(a->cell[0], a->cell[1]) > 0;
+  lval_del(a);
+  return lval_num(r);
 }
 
 lval* builtin_lt(lenv* e, lval* a)
 {
-  return builtin_ord(e, a, "<");
+  LASSERT_ORD("<", a);
+  int r = LNUM_CMP(a->cell[0], a->cell[1]) < 0;
+  lval_del(a);
+  return lval_num(r);
 }
 
 lval* builtin_ge(lenv* e, lval* a)
 {
-  return builtin_ord(e, a, ">=");
+  LASSERT_ORD(">=", a);
+  int r = LNUM_CMP(a->cell[0], a->cell[1]) >= 0;
+  lval_del(a);
+  return lval_num(r);
+}
+
+lval* builtin_le(lenv* e, lval* a)
+{
+  LASSERT_ORD("<=", a);
+  int r = LNUM_CMP(a->cell[0], a->cell[1]) <= 0;
+  lval_del(a);
+  return lval_num(r);
+}
+
+lval* builtin_eq(lenv* e, lval* a)
+{
+  LASSERT_NUM("==", a, 2);
+  int r = lval_eq(a->cell[0], a->cell[1]);
+  lval_del(a);
+  return lval_num(r);
+}
+
+lval* builtin_ne(lenv* e, lval* a)
+{
+  LASSERT_NUM("!=", a, 2);
+  int r = !lval_eq(a->cell[0], a->cell[1]);
+  lval_del(a);
+  return lval_num(r);
+}
+
+// Logic functions take numbers only, booleans are not accepted
+lval* builtin_or(lenv* e, lval* a)
+{
+  LASSERT(a, a->count > 0, "Function 'or' passed no arguments.");
+  long acc = 0;
+  int boxed = 0;
+  for (int i = 0; i < a->count; i++)
+    {
+      lval* y = a->cell[i];
+      if (LTYPE(y) != LVAL_NUM) { return lval_fold_err(a); }
+      boxed |= !LVAL_IMM(y);
+      acc |= LNUM(y);
+    }
+  return lval_fold_del(a, boxed, lval_num(acc));
+}
+
+lval* builtin_and(lenv* e, lval* a)
+{
+  LASSERT(a, a->count > 0, "Function 'and' passed no arguments.");
+  long acc = -1;
+  int boxed = 0;
+  for (int i = 0; i < a->count; i++)
+    {
+      lval* y = a->cell[i];
+      if (LTYPE(y) != LVAL_NUM) { return lval_fold_err(a); }
+      boxed |= !LVAL_IMM(y);
+      acc &= LNUM(y);
+    }
+  return lval_fold_del(a, boxed, lval_num(acc));
+}
+
+lval* builtin_not(lenv* e, lval* a)
+{
+  LASSERT_NUM("not", a, 1);
+  if (LTYPE(a->cell[0]) != LVAL_NUM) { return lval_fold_err(a); }
+  int r = !LNUM(a->cell[0]);
+  lval_del(a);
+  return lval_num(r);
+}
+
+lval* builtin_head(lenv* e, lval* a)
+{
+  LASSERT_NUM("head", a, 1);
+  LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
+  LASSERT_NOT_EMPTY("head", a, 0);
+
+  lval* v = lval_take(a, 0);
+  lval* x = lval_add(lval_qexpr(), lval_copy(v->cell[0]));
+  lval_del(v);
+  return x;
+}
+
+lval* builtin_tail(lenv* e, lval* a)
+//  Function returns qexpr without first element
+{
+  LASSERT_NUM("tail", a, 1);
+  LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
+  LASSERT_NOT_EMPTY("tail", a, 0);
+
+  lval* v = lval_unshare(lval_take(a, 0));
+  lval_del(lval_pop(v, 0));
+  return v;
+}
+
+// Native list functions. std.lspy keeps their Lisp definitions for
+// reference, these take time in the size of the result rather than
+// a call per element.
+
+// Element i of a Q-Expression or vector
+lval* lseq_get(lval* v, int i)
+{
+  return LTYPE(v) == LVAL_VECTOR ? lvec_get(v, i) : lval_copy(v->cell[i]);
+}
+
+// Elements from up to to of a Q-Expression or vector, which it takes
+// over. A list nothing else sees is cut in place, otherwise only the
+// slice is copied.
+lval* lseq_slice(lval* v, int from, int to)
+{
+  if (LTYPE(v) == LVAL_VECTOR)
+    {
+      lval* x = lval_vector(to - from, v->is_dbl);
+      if (x->len) { memcpy(x->longs, v->longs + from, LVEC_BYTES(x)); }
+      lval_del(v);
+      return x;
+    }
+  if (v->refs == 1 && lgc_mode == LGC_COPY)
+    {
+      v = lval_unshare(v);
+      for (int i = 0; i < from; i++) { lval_del(v->cell[i]); }
+      for (int i = to; i < v->count; i++) { lval_del(v->cell[i]); }
+      v->cell += from;
+      v->start += from;
+      v->count = to - from;
+      return v;
+    }
+  lval* x = lval_qexpr();
+  lval_reserve(x, to - from);
+  for (int i = from; i < to; i++) { x->cell[x->count++] = lval_copy(v->cell[i]); }
+  lval_del(v);
+  return x;
+}
+
+lval* builtin_len(lenv* e, lval* a)
+{
+  LASSERT_NUM("len", a, 1);
+  LASSERT_SEQ("len", a, 0);
+
+  lval* x = lval_num(LSEQ_LEN(a->cell[0]));
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_nth(lenv* e, lval* a)
+{
+  LASSERT_NUM("nth", a, 2);
+  LASSERT_TYPE("nth", a, 0, LVAL_NUM);
+  LASSERT_SEQ("nth", a, 1);
+  long n = LNUM(a->cell[0]);
+  LASSERT(a, n >= 0 && n < LSEQ_LEN(a->cell[1]),
+          "Function 'nth' passed index %li out of range.", n);
+
+  lval* x = lseq_get(a->cell[1], n);
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_last(lenv* e, lval* a)
+{
+  LASSERT_NUM("last", a, 1);
+  LASSERT_SEQ("last", a, 0);
+  LASSERT(a, LSEQ_LEN(a->cell[0]) > 0, "Function 'last' passed empty args!");
+
+  lval* x = lseq_get(a->cell[0], LSEQ_LEN(a->cell[0]) - 1);
+  lval_del(a);
+  return x;
+}
+
+// First n elements, or all if there are fewer
+lval* builtin_take(lenv* e, lval* a)
+{
+  LASSERT_NUM("take", a, 2);
+  LASSERT_TYPE("take", a, 0, LVAL_NUM);
+  LASSERT_SEQ("take", a, 1);
+  long n = LNUM(a->cell[0]);
+  LASSERT(a, n >= 0, "Function 'take' passed negative count %li.", n);
+
+  lval* v = lval_take(a, 1);
+  return lseq_slice(v, 0, n < LSEQ_LEN(v) ? n : LSEQ_LEN(v));
+}
+
+// All but the first n elements
+lval* builtin_drop(lenv* e, lval* a)
+{
+  LASSERT_NUM("drop", a, 2);
+  LASSERT_TYPE("drop", a, 0, LVAL_NUM);
+  LASSERT_SEQ("drop", a, 1);
+  long n = LNUM(a->cell[0]);
+  LASSERT(a, n >= 0, "Function 'drop' passed negative count %li.", n);
+
+  lval* v = lval_take(a, 1);
+  return lseq_slice(v, n < LSEQ_LEN(v) ? n : LSEQ_LEN(v), LSEQ_LEN(v));
+}
+
+lval* builtin_init(lenv* e, lval* a)
+//  Function returns qexpr without last element
+{
+  LASSERT_NUM("init", a, 1);
+  LASSERT_SEQ("init", a, 0);
+  LASSERT(a, LSEQ_LEN(a->cell[0]) > 0, "Function 'init' passed empty args!");
+
+  lval* v = lval_take(a, 0);
+  return lseq_slice(v, 0, LSEQ_LEN(v) - 1);
+}
+
+lval* builtin_cons(lenv* e, lval* a)
+//  Function returns qexpr with value put in front
+{
+  LASSERT_NUM("cons", a, 2);
+  LASSERT_TYPE("cons", a, 1, LVAL_QEXPR);
+
+  lval* x = lval_pop(a, 0);
+  lval* v = lval_unshare(lval_take(a, 0));
+  return lval_add_front(v, x);
+}
+
+lval* builtin_reverse(lenv* e, lval* a)
+{
+  LASSERT_NUM("reverse", a, 1);
+  LASSERT_SEQ("reverse", a, 0);
+
+  lval* v = lval_unshare(lval_take(a, 0));
+  for (int i = 0, j = LSEQ_LEN(v) - 1; i < j; i++, j--)
+    {
+      if (LTYPE(v) == LVAL_QEXPR)
+        {
+          lval* t = v->cell[i]; v->cell[i] = v->cell[j]; v->cell[j] = t;
+        }
+      else if (v->is_dbl)
+        {
+          double t = v->dbls[i]; v->dbls[i] = v->dbls[j]; v->dbls[j] = t;
+        }
+      else
+        {
+          long t = v->longs[i]; v->longs[i] = v->longs[j]; v->longs[j] = t;
+        }
+    }
+  return v;
+}
+
+lval* builtin_list(lenv* e, lval* a)
+{
+  a->type = LVAL_QEXPR;
+  return a;
+}
+
+lval* builtin_eval(lenv* e, lval* a)
+{
+  LASSERT_NUM("eval", a, 1);
+  LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
+
+  return lval_tail(e, lval_take(a, 0));
+}
+
+lval* builtin_join(lenv* e, lval* a)
+{
+  for (int i = 0; i < a->count; i++)
+    {
+      LASSERT_TYPE("join", a, i, LVAL_QEXPR);
+    }
+
+  // Allocate space for all elements at once
+  int total = 0;
+  for (int i = 0; i < a->count; i++) { total += a->cell[i]->count; }
+
+  lval* x = lval_unshare(lval_pop(a, 0));
+  lval_reserve(x, total - x->count);
+  while (a->count)
+    {
+      x = lval_join(x, lval_pop(a, 0));
+    }
+
+  lval_del(a);
+  return x;
+}
+
+lval* lval_join(lval* x, lval* y)
+{
+  x = lval_unshare(x);
+  lval_reserve(x, y->count);
+  if (y->refs == 1 && lgc_mode == LGC_COPY && y->count)
+    {
+      // Move elements of y over in one go
+      memcpy(x->cell + x->count, y->cell, sizeof(lval*) * y->count);
+      x->count += y->count;
+      y->count = 0;
+    }
+  else
+    {
+      // y is shared, so reference its elements instead
+      for (int i = 0; i < y->count; i++)
+        {
+          x->cell[x->count++] = lval_copy(y->cell[i]);
+        }
+    }
+  // Delete the empty 'y' and return 'x'
+  lval_del(y);
+  return x;
 }
 
-lval* builtin_le(lenv* e, lval* a)
+lval* lval_pop(lval* v, int i)
 {
-  return builtin_ord(e, a, "<=");
-}
+  // Find the item at "i"
+  lval* x = v->cell[i];
 
-lval* builtin_cmp(lenv* e, lval* a, char* op)
-{
-  LASSERT_NUM(op, a, 2);
-  int r = -1;
-  if (strcmp(op, "==") == 0)
+  if (i == 0)
     {
-      r = lval_eq(a->cell[0], a->cell[1]);
+      // Just move start of the array
+      v->cell++;
+      v->start++;
     }
-  else if (strcmp(op, "!=") == 0)
+  else
     {
-      r = !lval_eq(a->cell[0], a->cell[1]);
+      // Shift memory after the item at "i" over the top
+      memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count-i-1));
     }
-  lval_del(a);
-  return lval_num(r);
-}  
+  // Decrease the count of items in the list
+  v->count--;
+  return x;
+}
 
-lval* builtin_eq(lenv* e, lval* a)
+
+lval* lval_take(lval* v, int i)
 {
-  return builtin_cmp(e, a, "==");
+  lval* x = lval_pop(v, i);
+  lval_del(v);
+  return x;
 }
 
-lval* builtin_ne(lenv* e, lval* a)
+
+// Bytecode engine. Expressions are compiled to a flat sequence of
+// operations on a value stack, nested S-Expressions need no recursion.
+// if and \ with literal Q-Expressions are compiled in place, as their
+// symbols may be rebound each checks for the builtin when it runs and
+// else calls whatever it got.
+enum { OP_CONST, OP_LOOKUP, OP_CALL, OP_RETURN, OP_IF, OP_JUMP, OP_LAMBDA };
+
+typedef struct lcode
 {
-  return builtin_cmp(e, a, "!=");
+  // Opcodes each followed by its operands
+  int count;
+  int* ops;
+  // Values pushed by OP_CONST and symbols looked up by OP_LOOKUP
+  int nconsts;
+  lval** consts;
+  // Maximal depth of the value stack
+  int stack;
+} lcode;
+
+void lcode_del(lcode* c)
+{
+  for (int i = 0; i < c->nconsts; i++) { lval_del(c->consts[i]); }
+  free(c->consts);
+  free(c->ops);
+  free(c);
 }
 
-lval* builtin_or(lenv* e, lval* a)
+// Appends word w, returns where it is so jumps can be patched
+int lcode_word(lcode* c, int w)
 {
-  return builtin_logic_op(e, a, "or");
+  c->ops = realloc(c->ops, sizeof(int) * (c->count + 1));
+  c->ops[c->count] = w;
+  return c->count++;
 }
 
-lval* builtin_or_sym(lenv* e, lval* a)
+void lcode_emit(lcode* c, int op, int arg)
 {
-  return builtin_logic_op(e, a, "||");
+  lcode_word(c, op);
+  lcode_word(c, arg);
 }
 
-lval* builtin_and(lenv* e, lval* a)
+int lcode_const(lcode* c, lval* v)
 {
-  return builtin_logic_op(e, a, "and");
+  c->consts = realloc(c->consts, sizeof(lval*) * (c->nconsts + 1));
+  c->consts[c->nconsts] = lval_copy(v);
+  return c->nconsts++;
 }
 
-lval* builtin_and_sym(lenv* e, lval* a)
+void lcode_stack(lcode* c, int n)
 {
-  return builtin_logic_op(e, a, "&&");
+  if (n > c->stack) { c->stack = n; }
 }
 
-lval* builtin_not(lenv* e, lval* a)
+// Whether v is (name ...) with n elements, the ones after the name being
+// Q-Expressions
+int lcode_is_form(lval* v, char* name, int n)
 {
-  return builtin_logic_op(e, a, "not");
+  if (v->count != n || LTYPE(v->cell[0]) != LVAL_SYM
+      || strcmp(v->cell[0]->sym, name) != 0)
+    {
+      return 0;
+    }
+  for (int i = n == 4 ? 2 : 1; i < n; i++)
+    {
+      if (LTYPE(v->cell[i]) != LVAL_QEXPR) { return 0; }
+    }
+  return 1;
 }
 
-lval* builtin_not_sym(lenv* e, lval* a)
+void lcode_compile_sexpr(lcode* c, lval* v, int depth, int tail);
+
+// (if cond {then} {else}) as
+//   LOOKUP if, cond, IF k else end, then, JUMP end or RETURN,
+//   else: else, end: RETURN when in tail position
+// where consts k and k + 1 are the branches for calling another if
+void lcode_compile_if(lcode* c, lval* v, int depth, int tail)
 {
-  return builtin_logic_op(e, a, "!");
+  lcode_emit(c, OP_LOOKUP, lcode_const(c, v->cell[0]));
+  lval* cond = v->cell[1];
+  switch (LTYPE(cond))
+    {
+    case LVAL_SEXPR: lcode_compile_sexpr(c, cond, depth + 1, 0); break;
+    case LVAL_SYM: lcode_emit(c, OP_LOOKUP, lcode_const(c, cond)); break;
+    default: lcode_emit(c, OP_CONST, lcode_const(c, cond)); break;
+    }
+  lcode_stack(c, depth + 4);
+
+  int k = lcode_const(c, v->cell[2]);
+  lcode_const(c, v->cell[3]);
+  lcode_emit(c, OP_IF, k);
+  int to_else = lcode_word(c, 0);
+  int to_end = lcode_word(c, 0);
+
+  // Branches are evaluated as S-Expressions in place of the if
+  lval* then = lval_unshare(lval_copy(v->cell[2]));
+  then->type = LVAL_SEXPR;
+  lcode_compile_sexpr(c, then, depth, tail);
+  lval_del(then);
+  int skip = -1;
+  if (tail) { lcode_emit(c, OP_RETURN, 0); }
+  else
+    {
+      lcode_word(c, OP_JUMP);
+      skip = lcode_word(c, 0);
+    }
+
+  c->ops[to_else] = c->count;
+  lval* other = lval_unshare(lval_copy(v->cell[3]));
+  other->type = LVAL_SEXPR;
+  lcode_compile_sexpr(c, other, depth, tail);
+  lval_del(other);
+
+  c->ops[to_end] = c->count;
+  if (skip >= 0) { c->ops[skip] = c->count; }
+  if (tail) { lcode_emit(c, OP_RETURN, 0); }
 }
 
-lval* builtin_ord(lenv* e, lval* a, char* op)
+// (\ {formals} {body}) as LOOKUP \, LAMBDA k where consts k and k + 1 are
+// formals and body resolved as builtin_lambda does, and k + 2 and k + 3
+// the Q-Expressions for calling another lambda builtin
+int lcode_compile_lambda(lcode* c, lval* v, int depth)
 {
-  LASSERT_NUM(op, a, 2);
-  LASSERT_TYPE(op, a, 0, LVAL_NUM);
-  LASSERT(a, a->cell[1]->type == LVAL_NUM || a->cell[1]->type == LVAL_BOOL,                     
-          "Function '%s' passed incorrect type. "                       
-          "Got %s, Exptected %s or %s",
-          op, ltype_name(a->cell[1]->type),                    
-          ltype_name(LVAL_BOOL), ltype_name(LVAL_NUM));                                          
-
-  int r = 1000000000;
-  if (strcmp(op, ">") == 0)
+  lval* formals = v->cell[1];
+  for (int i = 0; i < formals->count; i++)
     {
-      r = (a->cell[0]->num > a->cell[1]->num);
+      if (LTYPE(formals->cell[i]) != LVAL_SYM) { return 0; }
     }
-  else if (strcmp(op, "<") == 0)
+  lcode_emit(c, OP_LOOKUP, lcode_const(c, v->cell[0]));
+  lcode_stack(c, depth + 3);
+
+  lscope scope = { lscope_frame(formals), NULL };
+  lval* f = lval_resolve(lval_copy(formals), &scope);
+  lval* body = lval_resolve(lval_copy(v->cell[2]), &scope);
+  lenv_del(scope.frame);
+  int k = lcode_const(c, f);
+  lcode_const(c, body);
+  lcode_const(c, v->cell[1]);
+  lcode_const(c, v->cell[2]);
+  lval_del(f);
+  lval_del(body);
+  lcode_emit(c, OP_LAMBDA, k);
+  return 1;
+}
+
+// Compile children of v followed by call of them, depth is height of
+// the stack before. In tail position the call is left pending.
+void lcode_compile_sexpr(lcode* c, lval* v, int depth, int tail)
+{
+  if (lcode_is_form(v, "if", 4))
     {
-      r = (a->cell[0]->num < a->cell[1]->num);
+      lcode_compile_if(c, v, depth, tail);
+      return;
     }
-  else if (strcmp(op, ">=") == 0)
+  if (lcode_is_form(v, "\\", 3) && lcode_compile_lambda(c, v, depth))
     {
-      r = (a->cell[0]->num >= a->cell[1]->num);
+      return;
     }
-  else if (strcmp(op, "<=") == 0)
+
+  for (int i = 0; i < v->count; i++)
     {
-      r = (a->cell[0]->num <= a->cell[1]->num);
+      lval* x = v->cell[i];
+      switch (LTYPE(x))
+        {
+        case LVAL_SEXPR: lcode_compile_sexpr(c, x, depth + i, 0); break;
+        case LVAL_SYM: lcode_emit(c, OP_LOOKUP, lcode_const(c, x)); break;
+        default: lcode_emit(c, OP_CONST, lcode_const(c, x)); break;
+        }
+      lcode_stack(c, depth + i + 1);
     }
-  lval_del(a);
-  return lval_num(r);
+  lcode_emit(c, OP_CALL, v->count);
+  lcode_stack(c, depth + 1);
 }
 
-lval* builtin_head(lenv* e, lval* a)
+// Bytecode of v evaluated as S-Expression, compiled once and cached
+lcode* lval_code(lval* v)
 {
-  LASSERT_NUM("head", a, 1);
-  LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
-  LASSERT_NOT_EMPTY("head", a, 0);
-
-  lval* v = lval_take(a, 0);
-  while (v->count > 1) { lval_del(lval_pop(v, 1)); }
-  return v;
+  if (!v->code)
+    {
+      lcode* c = calloc(1, sizeof(lcode));
+      lcode_compile_sexpr(c, v, 0, 1);
+      lcode_emit(c, OP_RETURN, 0);
+      v->code = c;
+    }
+  return v->code;
 }
 
-lval* builtin_tail(lenv* e, lval* a)
-//  Function returns qexpr without first element
+// Calls lambda f with the n values at args when they bind all of its
+// formals, the frame is filled straight from the stack. Returns NULL for
+// anything else, which lval_call handles.
+lval* lvm_call_lambda(lenv* e, lval* f, lval** args, int n)
 {
-  LASSERT_NUM("tail", a, 1);
-  LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
-  LASSERT_NOT_EMPTY("tail", a, 0);
-
-  lval* v = lval_take(a, 0);
-  lval_del(lval_pop(v, 0));
-  return v;
-}
+  static char* rest = NULL;
+  if (!rest) { rest = sym_intern("&"); }
 
-lval* builtin_init(lenv* e, lval* a)
-//  Function returns qexpr without first element
-{
-  LASSERT_NUM("init", a, 1);
-  LASSERT_TYPE("init", a, 0, LVAL_QEXPR);
-  LASSERT_NOT_EMPTY("init", a, 0);
+  lval* formals = f->formals;
+  if (formals->count != n) { return NULL; }
+  for (int i = 0; i < n; i++)
+    {
+      if (formals->cell[i]->sym == rest) { return NULL; }
+    }
 
-  lval* v = lval_take(a, 0);
-  lval_del(lval_pop(v, v->count - 1));
-  return v;
+  lenv* frame = lenv_copy(f->env);
+  for (int i = 0; i < n; i++)
+    {
+      lenv_bind(frame, formals->cell[i], args[i]);
+      lval_del(args[i]);
+    }
+  lenv_set_par(frame, e);
+  // Body is evaluated by the caller as with lval_call
+  lval* x = lval_tail(frame, lval_copy(f->body));
+  lenv_del(frame);
+  return x;
 }
 
-lval* builtin_len(lenv* e, lval* a)
-//  Function returns qexpr without first element
+// Applies the n values at args, the function first. Functions are called
+// without building the S-Expression lval_apply takes.
+lval* lvm_apply(lenv* e, lval** args, int n)
 {
-  LASSERT_NUM("len", a, 1);
-  LASSERT_TYPE("len", a, 0, LVAL_QEXPR);
-  LASSERT_NOT_EMPTY("len", a, 0);
+  lval* f = args[0];
+  int direct = n > 1 && LTYPE(f) == LVAL_FUN;
+  for (int i = 1; direct && i < n; i++)
+    {
+      if (LTYPE(args[i]) == LVAL_ERR) { direct = 0; }
+    }
+  if (direct && !f->builtin)
+    {
+      lval* x = lvm_call_lambda(e, f, args + 1, n - 1);
+      if (x)
+        {
+          lval_del(f);
+          return x;
+        }
+    }
 
-  lval* v = lval_take(a, 0);
-  lval* x = lval_num(v->count);
+  // Builtins take the arguments as a list, lval_apply the whole call
+  lval* x = lval_sexpr();
+  int from = direct && f->builtin ? 1 : 0;
+  x->count = n - from;
+  x->cap = n - from;
+  x->cell = lalloc(sizeof(lval*) * x->cap);
+  if (x->cap) { memcpy(x->cell, args + from, sizeof(lval*) * x->cap); }
+  if (!from) { return lval_apply(e, x); }
+  x = f->builtin(e, x);
+  lval_del(f);
   return x;
 }
 
-lval* builtin_cons(lenv* e, lval* a)
-//  Function returns qexpr without first element
+lval* lvm_run(lenv* e, lcode* c)
 {
-  LASSERT_NUM("cons", a, 2);
-  LASSERT_TYPE("cons", a, 0, LVAL_QEXPR);
-  LASSERT_TYPE("cons", a, 1, LVAL_NUM);
-  LASSERT_NOT_EMPTY("cons", a, 0);
+  // On the C stack so the collector finds the values on it
+  lval* stack[c->stack];
+  int sp = 0;
+  int* pc = c->ops;
+  lval* x;
+
+#ifdef __GNUC__
+  // Computed goto, each operation jumps straight to the next one
+  static void* labels[] = { &&L_OP_CONST, &&L_OP_LOOKUP, &&L_OP_CALL,
+                            &&L_OP_RETURN, &&L_OP_IF, &&L_OP_JUMP,
+                            &&L_OP_LAMBDA };
+#define LVM_DISPATCH() goto *labels[*pc++]
+#define LVM_CASE(op) L_##op
+#else
+#define LVM_DISPATCH() goto dispatch
+#define LVM_CASE(op) case op
+#endif
 
-  lval* v = lval_pop(a, 0);
-  lval* x = lval_pop(a, 0);
-  lval_add_front(v, x);
-  return v;
+  LVM_DISPATCH();
+#ifndef __GNUC__
+ dispatch:
+  switch (*pc++)
+#endif
+    {
+    LVM_CASE(OP_CONST):
+      stack[sp++] = lval_copy(c->consts[*pc++]);
+      LVM_DISPATCH();
+
+    LVM_CASE(OP_LOOKUP):
+      stack[sp++] = lenv_get(e, c->consts[*pc++]);
+      LVM_DISPATCH();
+
+    LVM_CASE(OP_CALL):
+      {
+        // Top n values are the function and its arguments
+        int n = *pc++;
+        sp -= n;
+        x = lvm_apply(e, &stack[sp], n);
+        // Only the last call is in tail position
+        stack[sp++] = *pc == OP_RETURN ? x : lval_force(x);
+      }
+      LVM_DISPATCH();
+
+    LVM_CASE(OP_RETURN):
+      return stack[--sp];
+
+    LVM_CASE(OP_IF):
+      {
+        int k = pc[0];
+        lval* f = stack[sp - 2];
+        lval* cond = stack[sp - 1];
+        if (LTYPE(f) == LVAL_FUN && f->builtin == builtin_if
+            && LTYPE(cond) == LVAL_NUM)
+          {
+            // Then branch follows, else one is at the first operand
+            int then = LNUM(cond) != 0;
+            lval_del(cond);
+            lval_del(f);
+            sp -= 2;
+            pc = then ? pc + 3 : c->ops + pc[1];
+            LVM_DISPATCH();
+          }
+        // Anything else is called with the branches as they are
+        int* end = c->ops + pc[2];
+        stack[sp++] = lval_copy(c->consts[k]);
+        stack[sp++] = lval_copy(c->consts[k + 1]);
+        sp -= 4;
+        x = lvm_apply(e, &stack[sp], 4);
+        stack[sp++] = *end == OP_RETURN ? x : lval_force(x);
+        pc = end;
+      }
+      LVM_DISPATCH();
+
+    LVM_CASE(OP_JUMP):
+      pc = c->ops + *pc;
+      LVM_DISPATCH();
+
+    LVM_CASE(OP_LAMBDA):
+      {
+        int k = *pc++;
+        lval* f = stack[sp - 1];
+        if (LTYPE(f) == LVAL_FUN && f->builtin == builtin_lambda)
+          {
+            lval_del(f);
+            stack[sp - 1] = lval_lambda(lval_copy(c->consts[k]),
+                                        lval_copy(c->consts[k + 1]));
+            LVM_DISPATCH();
+          }
+        stack[sp++] = lval_copy(c->consts[k + 2]);
+        stack[sp++] = lval_copy(c->consts[k + 3]);
+        sp -= 3;
+        x = lvm_apply(e, &stack[sp], 3);
+        stack[sp++] = *pc == OP_RETURN ? x : lval_force(x);
+      }
+      LVM_DISPATCH();
+    }
+#undef LVM_DISPATCH
+#undef LVM_CASE
+  return NULL;
 }
 
-lval* builtin_list(lenv* e, lval* a)
+
+// Mark and sweep collector of --gc=trace. Roots are the global enviroment
+// and every word of the evaluator stack, that is the C stack with the vm
+// value stacks on it and the registers. Words are scanned conservatively,
+// a word that looks like pointer to an allocated object keeps it alive.
+// Objects reached from roots are traced precisely.
+#if defined(__GNUC__)
+#define LGC_NO_SANITIZE __attribute__((no_sanitize_address))
+#else
+#define LGC_NO_SANITIZE
+#endif
+
+// Set by main to the outermost frame
+void* lgc_stack_base = NULL;
+lenv* lgc_root = NULL;
+
+// Marked objects whose children are not traced yet
+void** lgc_gray = NULL;
+int lgc_gray_count = 0;
+int lgc_gray_size = 0;
+
+void lgc_mark(void* p)
 {
-  a->type = LVAL_QEXPR;
-  return a;
+  if (!p || LVAL_IMM(p)) { return; }
+  lgc_page* g = (lgc_page*) LPAGE(p);
+  int i = ((char*) p - LGC_BLOCK(g, 0)) / g->size;
+  if (LGC_BIT(g->mark, i)) { return; }
+  g->mark[i >> 3] |= 1 << (i & 7);
+
+  if (lgc_gray_count == lgc_gray_size)
+    {
+      lgc_gray_size = lgc_gray_size ? lgc_gray_size * 2 : 256;
+      lgc_gray = realloc(lgc_gray, sizeof(void*) * lgc_gray_size);
+    }
+  lgc_gray[lgc_gray_count++] = p;
 }
 
-lval* builtin_eval(lenv* e, lval* a)
+// Mark object w points into, if any
+void lgc_mark_word(uintptr_t w)
 {
-  LASSERT_NUM("eval", a, 1);
-  LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
+  lgc_page* g = (lgc_page*) LPAGE(w);
+  int lo = 0;
+  int hi = lgc_pages_count;
+  while (lo < hi)
+    {
+      int mid = (lo + hi) / 2;
+      if (lgc_pages[mid] < g) { lo = mid + 1; }
+      else { hi = mid; }
+    }
+  if (lo == lgc_pages_count || lgc_pages[lo] != g) { return; }
+  if (w < (uintptr_t) LGC_BLOCK(g, 0)) { return; }
 
-  lval* x = lval_take(a, 0);
-  x->type = LVAL_SEXPR;
-  return lval_eval(e, x);
+  int i = (w - (uintptr_t) LGC_BLOCK(g, 0)) / g->size;
+  if (i < g->blocks && LGC_BIT(g->alloc, i)) { lgc_mark(LGC_BLOCK(g, i)); }
 }
 
-lval* builtin_join(lenv* e, lval* a)
+// Reads whole frames including the parts sanitizers consider off limits
+LGC_NO_SANITIZE void lgc_mark_range(void* from, void* to)
 {
-  for (int i = 0; i < a->count; i++)
+  uintptr_t p = ((uintptr_t) from + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+  for (; p + sizeof(void*) <= (uintptr_t) to; p += sizeof(void*))
     {
-      LASSERT_TYPE("join", a, i, LVAL_QEXPR);
+      lgc_mark_word(*(uintptr_t*) p);
     }
+}
 
-  lval* x = lval_pop(a, 0);
-  while (a->count)
+void lgc_trace(void)
+{
+  while (lgc_gray_count)
     {
-      x = lval_join(x, lval_pop(a, 0));
-    }
+      void* p = lgc_gray[--lgc_gray_count];
+      if (((lgc_page*) LPAGE(p))->type == LGC_LENV)
+        {
+          lenv* e = p;
+          lgc_mark(e->par);
+          for (int i = 0; e->slots && i < e->size; i++)
+            {
+              if (e->slots[i].sym) { lgc_mark(e->slots[i].val); }
+            }
+          continue;
+        }
 
-  lval_del(a);
-  return x;
+      lval* v = p;
+      switch (v->type)
+        {
+        case LVAL_FUN:
+          if (v->builtin) { break; }
+          lgc_mark(v->env);
+          lgc_mark(v->formals);
+          lgc_mark(v->body);
+          break;
+        case LVAL_TAIL:
+          lgc_mark(v->env);
+          lgc_mark(v->body);
+          break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+          for (int i = 0; v->cell && i < v->count; i++) { lgc_mark(v->cell[i]); }
+          if (v->code)
+            {
+              for (int i = 0; i < v->code->nconsts; i++)
+                {
+                  lgc_mark(v->code->consts[i]);
+                }
+            }
+          break;
+        }
+    }
 }
 
-lval* builtin_logic_op(lenv* e, lval* a, char* op)
+// Free what the owner would have freed in lval_del and lenv_del
+void lgc_finalize(lgc_page* g, void* p)
 {
-  // Ensure all arguments are number
-  for (int i = 0; i < a->count; i++)
+  if (g->type == LGC_LENV)
     {
-      if (a->cell[i]->type != LVAL_NUM)
+      lenv* e = p;
+      for (int i = 0; i < e->size; i++)
         {
-          lval_del(a);
-          return lval_err("Cannot operate on non-number");
+          if (e->slots[i].sym) { LSYM(e->slots[i].sym)->binds--; }
         }
+      lfree(e->slots, sizeof(lentry) * e->size);
+      return;
     }
 
-  // Pop the first element
-  lval* x = lval_pop(a, 0);
+  lval* v = p;
+  switch (v->type)
+    {
+    case LVAL_BIG: free(v->digits); break;
+    case LVAL_VECTOR: lfree(v->longs, LVEC_BYTES(v)); break;
+    case LVAL_ERR: free(v->err); break;
+    case LVAL_STRING: free(v->str); break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      if (v->cap) { lfree(v->cell - v->start, sizeof(lval*) * v->cap); }
+      if (v->code) { lcode_del(v->code); }
+      break;
+    }
+}
 
-  // If no arguments and sub then perform unary negation
-  if ((strcmp(op, "!") == 0 || strcmp(op, "not") == 0)  && a->count == 0)
+// Bytes of the array owned by object
+long lgc_array_size(lgc_page* g, void* p)
+{
+  if (g->type == LGC_LENV) { return sizeof(lentry) * ((lenv*) p)->size; }
+  lval* v = p;
+  if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR)
     {
-      x->num = !x->num;
+      return sizeof(lval*) * v->cap;
     }
-  while (a->count > 0)
+  if (v->type == LVAL_VECTOR) { return LVEC_BYTES(v); }
+  return 0;
+}
+
+// Free unmarked objects and rebuild free lists in address order
+void lgc_sweep(void)
+{
+  lgc_free[LGC_LVAL] = NULL;
+  lgc_free[LGC_LENV] = NULL;
+  lgc_stats.live[LGC_LVAL] = 0;
+  lgc_stats.live[LGC_LENV] = 0;
+  long live = 0;
+
+  for (int k = lgc_pages_count - 1; k >= 0; k--)
     {
-      lval* y = lval_pop(a, 0);
-    
-      if ((strcmp(op, "||") == 0) || (strcmp(op, "or") == 0))
-        {
-          x->num |= y->num;
-        }
-      else if (strcmp(op, "&&") == 0 || strcmp(op, "and") == 0)
+      lgc_page* g = lgc_pages[k];
+      for (int i = g->blocks - 1; i >= 0; i--)
         {
-          x->num &= y->num;
+          if (LGC_BIT(g->alloc, i) && !LGC_BIT(g->mark, i))
+            {
+              lgc_finalize(g, LGC_BLOCK(g, i));
+              g->alloc[i >> 3] &= ~(1 << (i & 7));
+              lgc_stats.freed[g->type]++;
+            }
+          if (LGC_BIT(g->alloc, i))
+            {
+              lgc_stats.live[g->type]++;
+              live += g->size + lgc_array_size(g, LGC_BLOCK(g, i));
+              continue;
+            }
+          ((lblock*) LGC_BLOCK(g, i))->next = lgc_free[g->type];
+          lgc_free[g->type] = (lblock*) LGC_BLOCK(g, i);
         }
-
-      lval_del(y);
+      memset(g->mark, 0, LGC_BITMAP);
     }
-  lval_del(a);
-  return x;
+
+  lgc_stats.allocated = 0;
+  lalloc_stats.bytes = 0;
+  lgc_threshold = live > LGC_MIN_HEAP ? live : LGC_MIN_HEAP;
 }
 
-lval* lval_join(lval* x, lval* y)
+#if defined(__GNUC__)
+// Not inlined so its frame lies below the registers spilled by the caller
+__attribute__((noinline)) void lgc_mark_stack(void)
 {
-  while (y->count)
-    {
-      x = lval_add(x, lval_pop(y, 0));
-    }
-  // Delete the empty 'y' and return 'x'
-  lval_del(y);
-  return x;
+  lgc_mark_range(__builtin_frame_address(0), lgc_stack_base);
 }
+#endif
 
-lval* lval_pop(lval* v, int i)
+void lgc_collect(void)
 {
-  // Find the item at "i"
-  lval* x = v->cell[i];
+  clock_t start = clock();
+
+  // Spill registers, values held only there are roots as well
+#if defined(__GNUC__)
+  // Callee saved registers go to this frame as they are, setjmp of glibc
+  // mangles rbp and would hide a value held only there
+  __builtin_unwind_init();
+  // Frames of all callers lie above the one of lgc_mark_stack
+  lgc_mark_stack();
+#else
+  jmp_buf regs;
+  setjmp(regs);
+  // Frames of all callers lie between regs and the base
+  lgc_mark_range(&regs, lgc_stack_base);
+#endif
+  lgc_mark(lgc_root);
+  lgc_trace();
+  lgc_sweep();
+
+  double pause = (double) (clock() - start) / CLOCKS_PER_SEC;
+  lgc_stats.collections++;
+  lgc_stats.total += pause;
+  if (pause > lgc_stats.pause) { lgc_stats.pause = pause; }
+}
 
-  // Shift memory after the item at "i" over the top
-  memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count-i-1));
-  // Decrease the count of items in the list
-  v->count--;
+void lgc_print_stats(void)
+{
+  if (lgc_mode == LGC_COPY)
+    {
+      puts("gc copy, values are freed by their last owner");
+      return;
+    }
+  printf("gc trace, %li collections, %.3f ms total, %.3f ms max pause\n",
+         lgc_stats.collections, lgc_stats.total * 1000,
+         lgc_stats.pause * 1000);
+  printf("live %li lvals, %li lenvs, freed %li lvals, %li lenvs\n",
+         lgc_stats.live[LGC_LVAL], lgc_stats.live[LGC_LENV],
+         lgc_stats.freed[LGC_LVAL], lgc_stats.freed[LGC_LENV]);
+  printf("heap %li pages, next collection after %li bytes\n",
+         lgc_stats.pages,
+         lgc_threshold - lgc_stats.allocated - lalloc_stats.bytes);
+}
 
-  //Reallocate the memory used
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-  return x;
+lval* lval_eval(lenv* e, lval* v)
+{
+  return lval_force(lval_eval_tail(e, v));
 }
 
+// Tail call of body evaluated in e
+lval* lval_tail(lenv* e, lval* body)
+{
+  lval* v = lgc_alloc(LGC_LVAL, sizeof(lval));
+  v->type = LVAL_TAIL;
+  v->refs = 1;
+  v->env = e;
+  e->refs++;
+  v->body = body;
+  return v;
+}
 
-lval* lval_take(lval* v, int i)
+// Run pending tail calls until there is a value
+lval* lval_force(lval* x)
 {
-  lval* x = lval_pop(v, i);
-  lval_del(v);
+  lenv* e = NULL;
+  while (LTYPE(x) == LVAL_TAIL)
+    {
+      lenv* next = x->env;
+      lval* body = lval_copy(x->body);
+      next->refs++;
+      // When only the call below keeps the current frame alive and it
+      // rebinds all its symbols, nothing can observe the frame anymore.
+      // Unlink it so loops run in constant memory as well. Traced frames
+      // are not counted, there the call is the only one left that can
+      // reach the frame unless a copied enviroment captured it.
+      if (e && next->par == e
+          && (lgc_mode == LGC_TRACE ? !e->captured : e->refs == 2)
+          && lenv_covers(next, e))
+        {
+          lenv_set_par(next, e->par);
+        }
+      lval_del(x);
+      if (e) { lenv_del(e); }
+      e = next;
+      x = lval_eval_body(e, body);
+    }
+  if (e) { lenv_del(e); }
   return x;
 }
 
-
-lval* lval_eval(lenv* e, lval* v)
+// Evaluate v, result can be pending tail call
+lval* lval_eval_tail(lenv* e, lval* v)
 {
-  if (v->type == LVAL_SYM){
+  if (LTYPE(v) == LVAL_SYM){
     lval* x = lenv_get(e, v);
     lval_del(v);
     return x;
   }
   
-  if (v->type == LVAL_SEXPR)
+  if (LTYPE(v) == LVAL_SEXPR)
     {
+      if (lval_engine == LENGINE_VM)
+        {
+          lval* x = lvm_run(e, lval_code(v));
+          lval_del(v);
+          return x;
+        }
       return lval_eval_sexpr(e, v);
     }
   return v;
 }
 
+// Evaluate Q-Expression as if it was S-Expression, result can be
+// pending tail call
+lval* lval_eval_body(lenv* e, lval* q)
+{
+  if (lval_engine == LENGINE_VM)
+    {
+      // q is usually shared part of function body, its code is reused
+      lval* x = lvm_run(e, lval_code(q));
+      lval_del(q);
+      return x;
+    }
+  q = lval_unshare(q);
+  q->type = LVAL_SEXPR;
+  return lval_eval_tail(e, q);
+}
+
 
 lval* lval_eval_sexpr(lenv* e, lval* v)
 {
+  // Children are replaced by their values
+  v = lval_unshare(v);
+
   // Evaluate children
   for (int i = 0; i < v->count; i++)
     {
       v->cell[i] = lval_eval(e, v->cell[i]);
     }
 
+  return lval_apply(e, v);
+}
+
+// Apply S-Expression with already evaluated children
+lval* lval_apply(lenv* e, lval* v)
+{
   // Error Checking
   for (int i = 0; i < v->count; i++)
     {
-      if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
+      if (LTYPE(v->cell[i]) == LVAL_ERR) { return lval_take(v, i); }
     }
 
   // Empty expression
@@ -1334,11 +5322,11 @@ lval* lval_eval_sexpr(lenv* e, lval* v)
 
   // Ensure first element is a fun
   lval * f = lval_pop(v, 0);
-  if (f->type != LVAL_FUN)
+  if (LTYPE(f) != LVAL_FUN)
     {
       lval* err = lval_err("S-expression starts with incorrct type. "
                            "Got %s, Expected %s",
-                           ltype_name(f->type), ltype_name(LVAL_FUN));
+                           ltype_name(LTYPE(f)), ltype_name(LVAL_FUN));
       lval_del(f);
       lval_del(v);
       return err;
@@ -1356,12 +5344,16 @@ char* ltype_name(int t)
     {
     case LVAL_FUN: return "Function";
     case LVAL_NUM: return "Number";
+    case LVAL_BIG: return "Number";
+    case LVAL_DBL: return "Double";
+    case LVAL_VECTOR: return "Vector";
     case LVAL_BOOL: return "Boolean";
     case LVAL_ERR: return "Error";
     case LVAL_SYM: return "Symbol";
     case LVAL_SEXPR: return "S-Expression";
     case LVAL_QEXPR: return "Q-Expression";
     case LVAL_STRING: return "String";
+    case LVAL_TAIL: return "Tail Call";
     default: return "Unknown";
     }
 }
@@ -1383,9 +5375,9 @@ int main(int argc, char** argv)
   // Define parser with language
   mpca_lang(MPCA_LANG_DEFAULT,
             "                                                   \
-              number : /-?[0-9]+/;                              \
+              number : /-?[0-9]+(\\.[0-9]+([eE][-+]?[0-9]+)?)?/; \
               boolean : /True|False/;                           \
-              string  : /\"(\\\\.|[^\"])*\"/ ;                  \
+              string  : /\"(\\\\.|[^\"\\\\])*\"/ ;              \
               comment : /;[^\\r\\n]*/ ;                         \
               symbol: /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/;         \
               sexpr  : '(' <expr>* ')';                         \
@@ -1396,63 +5388,185 @@ int main(int argc, char** argv)
               lispy  : /^/ <expr>* /$/;                         \
             ",
             Number, Boolean, String, Comment, Symbol, Sexpr, Qexpr, Expr, Lispy);
-  /* Print Version and Exit Infromation */
-  puts("Lisp Version 0.0.0.0.1");
-  puts("Press Ctrl+c to exit\n");
 
+  // Options are removed from argv, the rest are files to load
+  int files = 1;
+  int stats = 0;
+  for (int i = 1; i < argc; i++)
+    {
+      if (strcmp(argv[i], "--engine=tree") == 0) { lval_engine = LENGINE_TREE; }
+      else if (strcmp(argv[i], "--engine=vm") == 0) { lval_engine = LENGINE_VM; }
+      else if (strcmp(argv[i], "--arena") == 0) { lalloc_arena_mode = 1; }
+      else if (strcmp(argv[i], "--gc=copy") == 0) { lgc_mode = LGC_COPY; }
+      else if (strcmp(argv[i], "--gc=trace") == 0) { lgc_mode = LGC_TRACE; }
+      else if (strcmp(argv[i], "--stats") == 0) { stats = 1; }
+      else if (strcmp(argv[i], "--reader=native") == 0) { lval_reader = LREADER_NATIVE; }
+      else if (strcmp(argv[i], "--reader=mpc") == 0) { lval_reader = LREADER_MPC; }
+      else if (strcmp(argv[i], "--simd=scalar") == 0) { lsimd_level = LSIMD_SCALAR; }
+      else if (strcmp(argv[i], "--simd=sse4.2") == 0) { lsimd_level = LSIMD_SSE42; }
+      else if (strcmp(argv[i], "--simd=avx2") == 0) { lsimd_level = LSIMD_AVX2; }
+      else if (strncmp(argv[i], "--engine=", 9) == 0)
+        {
+          fprintf(stderr, "Unknown engine '%s'\n", argv[i] + 9);
+          return 1;
+        }
+      else if (strncmp(argv[i], "--gc=", 5) == 0)
+        {
+          fprintf(stderr, "Unknown gc '%s'\n", argv[i] + 5);
+          return 1;
+        }
+      else if (strncmp(argv[i], "--reader=", 9) == 0)
+        {
+          fprintf(stderr, "Unknown reader '%s'\n", argv[i] + 9);
+          return 1;
+        }
+      else if (strncmp(argv[i], "--simd=", 7) == 0)
+        {
+          fprintf(stderr, "Unknown simd '%s'\n", argv[i] + 7);
+          return 1;
+        }
+      else { argv[files++] = argv[i]; }
+    }
+  argc = files;
+  lreduce_init();
+
+  // The grammar is complete, so each or can dispatch on the next character
+  if (stats) { mpc_stats(Lispy); }
+  mpc_optimise(Number);
+  mpc_optimise(Boolean);
+  mpc_optimise(String);
+  mpc_optimise(Comment);
+  mpc_optimise(Symbol);
+  mpc_optimise(Sexpr);
+  mpc_optimise(Qexpr);
+  mpc_optimise(Expr);
+  mpc_optimise(Lispy);
+  if (stats) { mpc_stats(Lispy); }
+
+  // Mode is fixed before the first lval is allocated
   lenv* e = lenv_new();
   lenv_add_builtins(e);
+  lgc_root = e;
+#ifdef __GNUC__
+  lgc_stack_base = __builtin_frame_address(0);
+#else
+  lgc_stack_base = &argc + 1;
+#endif
 
   if (argc == 1)
     {
+      /* Print Version and Exit Infromation */
+      puts("Lisp Version 0.0.0.0.1");
+      puts("Press Ctrl+c to exit\n");
+
+      // Forms are gathered until no line is left open, so an expression
+      // can span lines
+      lstream in;
+      lstream_init(&in, "<stdin>");
+      lval* forms = NULL;
       while (1)
         {
           // Output our prompt
-          char * input = readline("lispy> ");
+          char * input = readline(lstream_pending(&in) ? "...... " : "lispy> ");
+          // End of input
+          if (!input) { break; }
           // Add input to history
           add_history(input);
 
           // Attempt to prase the user input
-          mpc_result_t r;
-          if (mpc_parse("<stdin>", input, Lispy, &r))
+          lval* x = NULL;
+          if (lval_reader == LREADER_MPC)
             {
-              mpc_ast_print(r.output);
-              lval* result = lval_eval(e, lval_read(r.output));
-              lval_println(result);
-              lval_del(result);
-              mpc_ast_delete(r.output);
+              mpc_result_t r;
+              if (mpc_parse("<stdin>", input, Lispy, &r))
+                {
+                  mpc_ast_print(r.output);
+                  x = lval_read(r.output);
+                  mpc_ast_delete(r.output);
+                }
+              else
+                {
+                  mpc_err_print(r.error);
+                  mpc_err_delete(r.error);
+                }
             }
           else
             {
-              mpc_err_print(r.error);
-              mpc_err_delete(r.error);
+              lstream_feed(&in, input, strlen(input));
+              lstream_feed(&in, "\n", 1);
+              if (!forms) { forms = lval_sexpr(); }
+              char* err_msg;
+              lval* y;
+              while ((y = lstream_next(&in, &err_msg))) { lval_add(forms, y); }
+              if (err_msg)
+                {
+                  puts(err_msg);
+                  free(err_msg);
+                  lval_del(forms);
+                  forms = NULL;
+                }
+              else if (!lstream_pending(&in))
+                {
+                  x = forms;
+                  forms = NULL;
+                }
+            }
+
+          if (x)
+            {
+              lalloc_arena_begin();
+              lval* result = lval_eval(e, x);
+              lval_println(result);
+              lval_del(result);
+              lalloc_arena_end();
             }
         
           // Free input
           free(input);
         }
+      if (forms) { lval_del(forms); }
+      lstream_free(&in);
     }
   else if (argc >= 2)
     {
       // loop over each supplied filename (string from 1)
       for (int i = 1; i < argc; i++)
         {
+          // '-' evaluates forms of stdin as they arrive, for pipelines
+          if (strcmp(argv[i], "-") == 0)
+            {
+              char* err_msg;
+              if (!lread_eval(e, stdin, "<stdin>", &err_msg))
+                {
+                  puts(err_msg);
+                  free(err_msg);
+                }
+              continue;
+            }
           // Argument list with a signle argument, the filename
           lval* args = lval_add(lval_sexpr(), lval_str(argv[i]));
           // Pass to builtin load and get the result
           lval* x = builtin_load(e, args);
           // If resul it an error be sure to print it
-          if (x->type == LVAL_ERR)
+          if (LTYPE(x) == LVAL_ERR)
             {
               lval_println(x);
             }
           lval_del(x);
         }
     }
+
+  // Read by bench
+  if (stats)
+    {
+      fprintf(stderr, "allocs %li collections %li\n", lalloc_stats.allocs,
+              lgc_stats.collections);
+    }
     
   mpc_cleanup(9, Number, Boolean, String, Comment, Symbol, Sexpr, Qexpr, Expr,
               Lispy);
   lenv_del(e);
+  sym_table_del();
   return 0;
 }
 
@@ -1,5 +1,12 @@
 #include "mpc.h"
 
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 /*
 ** State Type
 */
@@ -69,6 +76,28 @@ enum {
   MPC_INPUT_MEM_NUM = 512
 };
 
+enum {
+  MPC_INPUT_BUFFER_MIN = 64
+};
+
+/* Packrat results, a power of two so memory stays bounded */
+enum {
+  MPC_INPUT_MEMO_NUM = 4096
+};
+
+typedef struct {
+  mpc_parser_t *p;
+  long pos;
+  /* Whether errors were suppressed, which changes the errors built */
+  int suppress;
+  int success;
+  mpc_state_t state;
+  char last;
+  mpc_val_t *output;
+  mpc_dtor_t dx;
+  mpc_err_t *error;
+} mpc_memo_t;
+
 typedef struct {
   char mem[64];
 } mpc_mem_t;
@@ -80,11 +109,20 @@ typedef struct {
   mpc_state_t state;
   
   char *string;
+  /* Length of string, so the end is found without strlen */
+  long length;
+  /* Whether string is a copy freed with the input */
+  int string_owned;
+  /* Characters read from pipe since the first mark */
   char *buffer;
+  long buffer_len;
+  long buffer_slots;
   FILE *file;
   
   int suppress;
   int backtrack;
+  /* Whether compiled regexes and first sets are used, off when a failed parse is repeated */
+  int compiled;
   int marks_slots;
   int marks_num;
   mpc_state_t *marks;
@@ -92,6 +130,9 @@ typedef struct {
   char *lasts;
   char last;
   
+  /* Allocated on the first packrat parser run */
+  mpc_memo_t *memo;
+  
   size_t mem_index;
   char mem_full[MPC_INPUT_MEM_NUM];
   mpc_mem_t mem[MPC_INPUT_MEM_NUM];
@@ -108,18 +149,24 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   
   i->state = mpc_state_new();
   
-  i->string = malloc(strlen(string) + 1);
-  strcpy(i->string, string);
+  i->length = strlen(string);
+  i->string = malloc(i->length + 1);
+  memcpy(i->string, string, i->length + 1);
+  i->string_owned = 1;
   i->buffer = NULL;
+  i->buffer_len = 0;
+  i->buffer_slots = 0;
   i->file = NULL;
   
   i->suppress = 0;
   i->backtrack = 1;
+  i->compiled = 1;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
   i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
+  i->memo = NULL;
   
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
@@ -127,6 +174,17 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   return i;
 }
 
+/* String input reading length characters of string in place */
+static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *string, size_t length) {
+  
+  mpc_input_t *i = mpc_input_new_string(filename, "");
+  free(i->string);
+  i->string = (char*)string;
+  i->length = length;
+  i->string_owned = 0;
+  return i;
+}
+
 static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
@@ -138,16 +196,22 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->state = mpc_state_new();
   
   i->string = NULL;
+  i->length = 0;
+  i->string_owned = 0;
   i->buffer = NULL;
+  i->buffer_len = 0;
+  i->buffer_slots = 0;
   i->file = pipe;
   
   i->suppress = 0;
   i->backtrack = 1;
+  i->compiled = 1;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
   i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
+  i->memo = NULL;
   
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
@@ -166,16 +230,22 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->state = mpc_state_new();
   
   i->string = NULL;
+  i->length = 0;
+  i->string_owned = 0;
   i->buffer = NULL;
+  i->buffer_len = 0;
+  i->buffer_slots = 0;
   i->file = file;
   
   i->suppress = 0;
   i->backtrack = 1;
+  i->compiled = 1;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
   i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
+  i->memo = NULL;
   
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
@@ -185,11 +255,21 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
 
 static void mpc_input_delete(mpc_input_t *i) {
   
+  int j;
+  
   free(i->filename);
   
-  if (i->type == MPC_INPUT_STRING) { free(i->string); }
+  if (i->type == MPC_INPUT_STRING && i->string_owned) { free(i->string); }
   if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
   
+  if (i->memo) {
+    for (j = 0; j < MPC_INPUT_MEMO_NUM; j++) {
+      if (i->memo[j].output) { i->memo[j].dx(i->memo[j].output); }
+      if (i->memo[j].error) { mpc_err_delete(i->memo[j].error); }
+    }
+    free(i->memo);
+  }
+  
   free(i->marks);
   free(i->lasts);
   free(i);
@@ -281,7 +361,9 @@ static void mpc_input_mark(mpc_input_t *i) {
   i->lasts[i->marks_num-1] = i->last;
   
   if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
+    i->buffer_slots = MPC_INPUT_BUFFER_MIN;
+    i->buffer_len = 0;
+    i->buffer = malloc(i->buffer_slots);
   }
   
 }
@@ -304,6 +386,8 @@ static void mpc_input_unmark(mpc_input_t *i) {
   if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
     free(i->buffer);
     i->buffer = NULL;
+    i->buffer_len = 0;
+    i->buffer_slots = 0;
   }
   
 }
@@ -319,11 +403,16 @@ static void mpc_input_rewind(mpc_input_t *i) {
     fseek(i->file, i->state.pos, SEEK_SET);
   }
   
+  /* Buffered pipe input is not at its end even after reading it */
+  if (i->type == MPC_INPUT_PIPE) {
+    clearerr(i->file);
+  }
+  
   mpc_input_unmark(i);
 }
 
 static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (long)(strlen(i->buffer) + i->marks[0].pos);
+  return i->state.pos < i->buffer_len + i->marks[0].pos;
 }
 
 static char mpc_input_buffer_get(mpc_input_t *i) {
@@ -331,7 +420,7 @@ static char mpc_input_buffer_get(mpc_input_t *i) {
 }
 
 static int mpc_input_terminated(mpc_input_t *i) {
-  if (i->type == MPC_INPUT_STRING && i->state.pos == (long)strlen(i->string)) { return 1; }
+  if (i->type == MPC_INPUT_STRING && i->state.pos == i->length) { return 1; }
   if (i->type == MPC_INPUT_FILE && feof(i->file)) { return 1; }
   if (i->type == MPC_INPUT_PIPE && feof(i->file)) { return 1; }
   return 0;
@@ -343,7 +432,8 @@ static char mpc_input_getc(mpc_input_t *i) {
   
   switch (i->type) {
     
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_STRING:
+      return i->state.pos < i->length ? i->string[i->state.pos] : '\0';
     case MPC_INPUT_FILE: c = fgetc(i->file); return c;
     case MPC_INPUT_PIPE:
     
@@ -366,7 +456,8 @@ static char mpc_input_peekc(mpc_input_t *i) {
   char c = '\0';
   
   switch (i->type) {
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_STRING:
+      return i->state.pos < i->length ? i->string[i->state.pos] : '\0';
     case MPC_INPUT_FILE: 
       
       c = fgetc(i->file);
@@ -422,9 +513,11 @@ static int mpc_input_success(mpc_input_t *i, char c, char **o) {
   
   if (i->type == MPC_INPUT_PIPE
   &&  i->buffer && !mpc_input_buffer_in_range(i)) {
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
+    if (i->buffer_len == i->buffer_slots) {
+      i->buffer_slots *= 2;
+      i->buffer = realloc(i->buffer, i->buffer_slots);
+    }
+    i->buffer[i->buffer_len++] = c;
   }
   
   i->last = c;
@@ -819,6 +912,84 @@ static mpc_err_t *mpc_err_merge(mpc_input_t *i, mpc_err_t *x, mpc_err_t *y) {
   return mpc_err_or(i, errs, 2);
 }
 
+/*
+** Packrat results are kept in a table indexed by
+** parser and position. A new result replaces the
+** one in its slot, so the memory used is bounded.
+*/
+
+static mpc_err_t *mpc_err_copy(mpc_input_t *i, mpc_err_t *x) {
+  int j;
+  mpc_err_t *e = mpc_malloc(i, sizeof(mpc_err_t));
+  *e = *x;
+  e->filename = mpc_malloc(i, strlen(x->filename) + 1);
+  strcpy(e->filename, x->filename);
+  e->failure = NULL;
+  if (x->failure) {
+    e->failure = mpc_malloc(i, strlen(x->failure) + 1);
+    strcpy(e->failure, x->failure);
+  }
+  e->expected = NULL;
+  if (x->expected_num) {
+    e->expected = mpc_malloc(i, sizeof(char*) * x->expected_num);
+  }
+  for (j = 0; j < x->expected_num; j++) {
+    e->expected[j] = mpc_malloc(i, strlen(x->expected[j]) + 1);
+    strcpy(e->expected[j], x->expected[j]);
+  }
+  return e;
+}
+
+static mpc_memo_t *mpc_input_memo(mpc_input_t *i, mpc_parser_t *p, long pos) {
+  size_t h;
+  if (i->memo == NULL) {
+    i->memo = calloc(MPC_INPUT_MEMO_NUM, sizeof(mpc_memo_t));
+  }
+  h = ((size_t)p >> 4) * 31 + (size_t)pos * 2654435761UL;
+  return &i->memo[(h ^ (h >> 12)) & (MPC_INPUT_MEMO_NUM - 1)];
+}
+
+static int mpc_input_memo_found(mpc_input_t *i, mpc_memo_t *m, mpc_parser_t *p) {
+  return m->p == p && m->pos == i->state.pos && m->suppress == (i->suppress > 0);
+}
+
+static void mpc_input_memo_free(mpc_memo_t *m) {
+  if (m->output) { m->dx(m->output); }
+  if (m->error) { mpc_err_delete(m->error); }
+  m->p = NULL;
+  m->output = NULL;
+  m->error = NULL;
+}
+
+static void mpc_input_memo_clear(mpc_input_t *i) {
+  int j;
+  if (i->memo == NULL) { return; }
+  for (j = 0; j < MPC_INPUT_MEMO_NUM; j++) { mpc_input_memo_free(&i->memo[j]); }
+}
+
+static void mpc_input_memo_store(mpc_input_t *i, mpc_memo_t *m, mpc_parser_t *p, long pos,
+  int x, mpc_result_t *r, mpc_apply_t copy, mpc_dtor_t dx) {
+  mpc_input_memo_free(m);
+  m->p = p;
+  m->pos = pos;
+  m->suppress = i->suppress > 0;
+  m->success = x;
+  m->state = i->state;
+  m->last = i->last;
+  if (x && r->output) { m->output = copy(r->output); }
+  if (!x && r->error) { m->error = mpc_err_export(i, mpc_err_copy(i, r->error)); }
+  m->dx = dx;
+}
+
+/* Moves input to where a stored result ended, piped input is still buffered from the first mark */
+static void mpc_input_memo_jump(mpc_input_t *i, mpc_memo_t *m) {
+  i->state = m->state;
+  i->last = m->last;
+  if (i->type == MPC_INPUT_FILE) {
+    fseek(i->file, i->state.pos, SEEK_SET);
+  }
+}
+
 /*
 ** Parser Type
 */
@@ -851,7 +1022,10 @@ enum {
   MPC_TYPE_COUNT     = 22,
   
   MPC_TYPE_OR        = 23,
-  MPC_TYPE_AND       = 24
+  MPC_TYPE_AND       = 24,
+  
+  MPC_TYPE_DFA       = 25,
+  MPC_TYPE_PACKRAT   = 26
 };
 
 typedef struct { char *m; } mpc_pdata_fail_t;
@@ -867,8 +1041,10 @@ typedef struct { mpc_parser_t *x; mpc_apply_to_t f; void *d; } mpc_pdata_apply_t
 typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
-typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
+typedef struct { int n; mpc_parser_t **xs; unsigned char *first; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
+typedef struct { mpc_parser_t *x; int n; unsigned char *table; unsigned char *accept; } mpc_pdata_dfa_t;
+typedef struct { mpc_parser_t *x; mpc_apply_t copy; mpc_dtor_t dx; } mpc_pdata_packrat_t;
 
 typedef union {
   mpc_pdata_fail_t fail;
@@ -886,6 +1062,8 @@ typedef union {
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
   mpc_pdata_or_t or;
+  mpc_pdata_dfa_t dfa;
+  mpc_pdata_packrat_t packrat;
 } mpc_pdata_t;
 
 struct mpc_parser_t {
@@ -965,35 +1143,147 @@ static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
   d(mpc_export(i, x));
 }
 
+/*
+** Run a compiled regex over the input with one table
+** lookup per character. The longest prefix ending in
+** an accepting state is consumed, the same text the
+** combinators of the regex match (see mpc_re_dfa).
+*/
+
+static int mpc_input_dfa(mpc_input_t *i, mpc_pdata_dfa_t *d, char **o) {
+  
+  long j, n = 0, len = -1;
+  int s = 1;
+  char c;
+  
+  if (d->accept[s]) { len = 0; }
+  
+  if (i->type == MPC_INPUT_STRING) {
+    for (j = i->state.pos; j < i->length; j++) {
+      s = d->table[s * 256 + (unsigned char)i->string[j]];
+      if (s == 0) { break; }
+      if (d->accept[s]) { len = j + 1 - i->state.pos; }
+    }
+  } else {
+    mpc_input_mark(i);
+    while (1) {
+      c = mpc_input_getc(i);
+      if (mpc_input_terminated(i)) { break; }
+      s = d->table[s * 256 + (unsigned char)c];
+      if (s == 0) { mpc_input_failure(i, c); break; }
+      mpc_input_success(i, c, NULL);
+      n++;
+      if (d->accept[s]) { len = n; }
+    }
+    mpc_input_rewind(i);
+  }
+  
+  if (len < 0) { return 0; }
+  
+  *o = mpc_malloc(i, len + 1);
+  for (j = 0; j < len; j++) {
+    c = mpc_input_getc(i);
+    mpc_input_success(i, c, NULL);
+    (*o)[j] = c;
+  }
+  (*o)[len] = '\0';
+  return 1;
+}
+
+/*
+** Parsers are run over an explicit stack of frames
+** instead of by recursion, so deeply nested input
+** only grows a heap allocated stack. A parser is
+** entered once and then resumed each time a parser
+** it runs returns, with that result in x and y.
+*/
+
 enum {
-  MPC_PARSE_STACK_MIN = 4
+  MPC_PARSE_STACK_MIN = 4,
+  MPC_PARSE_FRAMES_MIN = 64
 };
 
-#define MPC_SUCCESS(x) r->output = x; return 1
-#define MPC_FAILURE(x) r->error = x; return 0
-#define MPC_PRIMITIVE(x) \
-  if (x) { MPC_SUCCESS(r->output); } \
+typedef struct {
+  mpc_parser_t *p;
+  int j;
+  int k;
+  long pos;
+  int results_slots;
+  mpc_result_t *results;
+  mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
+} mpc_parse_frame_t;
+
+/* Next alternative of or from j which can start with character k */
+static int mpc_parse_or_next(mpc_parser_t *p, int j, int k) {
+  if (k < 0) { return j; }
+  while (j < p->data.or.n && !(p->data.or.first[j * 32 + k / 8] & (1 << (k % 8)))) { j++; }
+  return j;
+}
+
+#define MPC_RESULTS(f) ((f)->results ? (f)->results : (f)->results_stk)
+
+#define MPC_CALL(c) \
+  q = c; \
+  if (n == slots) { \
+    slots *= 2; \
+    frames = realloc(frames, sizeof(mpc_parse_frame_t) * slots); \
+  } \
+  frames[n++].p = q; \
+  goto enter
+
+#define MPC_SUCCESS(v) y.output = v; x = 1; goto leave
+#define MPC_FAILURE(v) y.error = v; x = 0; goto leave
+#define MPC_PRIMITIVE(c) \
+  if (c) { x = 1; goto leave; } \
   else { MPC_FAILURE(NULL); }
 
 static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
   
-  int j = 0, k = 0;
-  mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
-  mpc_result_t *results;
-  int results_slots = MPC_PARSE_STACK_MIN;
+  int n = 0, slots = MPC_PARSE_FRAMES_MIN, x = 0, k;
+  mpc_parse_frame_t *frames = malloc(sizeof(mpc_parse_frame_t) * slots);
+  mpc_parse_frame_t *f;
+  mpc_parser_t *q;
+  mpc_result_t y, *results;
+  mpc_memo_t *m;
+  
+  frames[n++].p = p;
+  
+enter:
+  
+  f = &frames[n-1];
+  p = f->p;
   
   switch (p->type) {
       
     /* Basic Parsers */
 
-    case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&r->output));
-    case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, p->data.single.x, (char**)&r->output));
-    case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, p->data.range.x, p->data.range.y, (char**)&r->output));
-    case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_oneof(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_noneof(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&r->output));
-    case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&r->output));
+    case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&y.output));
+    case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, p->data.single.x, (char**)&y.output));
+    case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, p->data.range.x, p->data.range.y, (char**)&y.output));
+    case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_oneof(i, p->data.string.x, (char**)&y.output));
+    case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_noneof(i, p->data.string.x, (char**)&y.output));
+    case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&y.output));
+    case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&y.output));
+    case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&y.output));
+    
+    /* Compiled regex, without backtracking the combinators may fail part way */
+    
+    case MPC_TYPE_DFA:
+      if (i->backtrack < 1 || !i->compiled) { f->p = p->data.dfa.x; goto enter; }
+      MPC_PRIMITIVE(mpc_input_dfa(i, &p->data.dfa, (char**)&y.output));
+    
+    /* Packrat parser, errors merged while finding a stored result are already in e */
+    
+    case MPC_TYPE_PACKRAT:
+      if (i->backtrack < 1) { f->p = p->data.packrat.x; goto enter; }
+      m = mpc_input_memo(i, p, i->state.pos);
+      if (mpc_input_memo_found(i, m, p)) {
+        mpc_input_memo_jump(i, m);
+        if (!m->success) { MPC_FAILURE(m->error ? mpc_err_copy(i, m->error) : NULL); }
+        MPC_SUCCESS(m->output ? p->data.packrat.copy(m->output) : NULL);
+      }
+      f->pos = i->state.pos;
+      MPC_CALL(p->data.packrat.x);
     
     /* Other parsers */
     
@@ -1006,206 +1296,245 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
     
     /* Application Parsers */
     
-    case MPC_TYPE_APPLY:
-      if (mpc_parse_run(i, p->data.apply.x, r, e)) {
-        MPC_SUCCESS(mpc_parse_apply(i, p->data.apply.f, r->output));
-      } else {
-        MPC_FAILURE(r->output);
-      }
-    
-    case MPC_TYPE_APPLY_TO:
-      if (mpc_parse_run(i, p->data.apply_to.x, r, e)) {
-        MPC_SUCCESS(mpc_parse_apply_to(i, p->data.apply_to.f, r->output, p->data.apply_to.d));
-      } else {
-        MPC_FAILURE(r->error);
-      }
+    case MPC_TYPE_APPLY:    MPC_CALL(p->data.apply.x);
+    case MPC_TYPE_APPLY_TO: MPC_CALL(p->data.apply_to.x);
     
     case MPC_TYPE_EXPECT:
       mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.expect.x, r, e)) {
-        mpc_input_suppress_disable(i);
-        MPC_SUCCESS(r->output);
-      } else {
-        mpc_input_suppress_disable(i);
-        MPC_FAILURE(mpc_err_new(i, p->data.expect.m));
-      }
+      MPC_CALL(p->data.expect.x);
     
     case MPC_TYPE_PREDICT:
       mpc_input_backtrack_disable(i);
-      if (mpc_parse_run(i, p->data.predict.x, r, e)) {      
-        mpc_input_backtrack_enable(i);
-        MPC_SUCCESS(r->output);
-      } else {
-        mpc_input_backtrack_enable(i);
-        MPC_FAILURE(r->error);
-      }
+      MPC_CALL(p->data.predict.x);
     
     /* Optional Parsers */
     
-    /* TODO: Update Not Error Message */
-    
     case MPC_TYPE_NOT:
       mpc_input_mark(i);
       mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.not.x, r, e)) {
+      MPC_CALL(p->data.not.x);
+    
+    case MPC_TYPE_MAYBE: MPC_CALL(p->data.not.x);
+    
+    /* Repeat Parsers */
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      f->j = 0;
+      f->results = NULL;
+      f->results_slots = MPC_PARSE_STACK_MIN;
+      MPC_CALL(p->data.repeat.x);
+    
+    case MPC_TYPE_COUNT:
+      f->j = 0;
+      f->results = p->data.repeat.n > MPC_PARSE_STACK_MIN
+        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.repeat.n)
+        : NULL;
+      MPC_CALL(p->data.repeat.x);
+    
+    /* Combinatory Parsers */
+    
+    case MPC_TYPE_OR:
+      if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
+      /* Skip alternatives which cannot start with the next character */
+      f->k = p->data.or.first && i->compiled ? (unsigned char)mpc_input_peekc(i) : -1;
+      f->j = mpc_parse_or_next(p, 0, f->k);
+      if (f->j == p->data.or.n) { MPC_FAILURE(NULL); }
+      MPC_CALL(p->data.or.xs[f->j]);
+    
+    case MPC_TYPE_AND:
+      if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
+      f->j = 0;
+      f->results = p->data.and.n > MPC_PARSE_STACK_MIN
+        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.and.n)
+        : NULL;
+      mpc_input_mark(i);
+      MPC_CALL(p->data.and.xs[0]);
+    
+    /* End */
+    
+    default:
+      MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
+  }
+  
+leave:
+  
+  if (--n == 0) {
+    free(frames);
+    *r = y;
+    return x;
+  }
+  
+  f = &frames[n-1];
+  p = f->p;
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_PACKRAT:
+      m = mpc_input_memo(i, p, f->pos);
+      mpc_input_memo_store(i, m, p, f->pos, x, &y, p->data.packrat.copy, p->data.packrat.dx);
+      goto leave;
+    
+    case MPC_TYPE_APPLY:
+      if (x) { MPC_SUCCESS(mpc_parse_apply(i, p->data.apply.f, y.output)); }
+      goto leave;
+    
+    case MPC_TYPE_APPLY_TO:
+      if (x) { MPC_SUCCESS(mpc_parse_apply_to(i, p->data.apply_to.f, y.output, p->data.apply_to.d)); }
+      goto leave;
+    
+    case MPC_TYPE_EXPECT:
+      mpc_input_suppress_disable(i);
+      if (x) { goto leave; }
+      MPC_FAILURE(mpc_err_new(i, p->data.expect.m));
+    
+    case MPC_TYPE_PREDICT:
+      mpc_input_backtrack_enable(i);
+      goto leave;
+    
+    /* TODO: Update Not Error Message */
+    
+    case MPC_TYPE_NOT:
+      if (x) {
         mpc_input_rewind(i);
         mpc_input_suppress_disable(i);
-        mpc_parse_dtor(i, p->data.not.dx, r->output);
+        mpc_parse_dtor(i, p->data.not.dx, y.output);
         MPC_FAILURE(mpc_err_new(i, "opposite"));
-      } else {
-        mpc_input_unmark(i);
-        mpc_input_suppress_disable(i);
-        MPC_SUCCESS(p->data.not.lf());
       }
+      mpc_input_unmark(i);
+      mpc_input_suppress_disable(i);
+      MPC_SUCCESS(p->data.not.lf());
     
     case MPC_TYPE_MAYBE:
-      if (mpc_parse_run(i, p->data.not.x, r, e)) {
-        MPC_SUCCESS(r->output);
-      } else {
-        *e = mpc_err_merge(i, *e, r->error);
-        MPC_SUCCESS(p->data.not.lf());
-      }
-    
-    /* Repeat Parsers */
+      if (x) { goto leave; }
+      *e = mpc_err_merge(i, *e, y.error);
+      MPC_SUCCESS(p->data.not.lf());
     
     case MPC_TYPE_MANY:
-      
-      results = results_stk;
-      
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
-        j++;
-        if (j == MPC_PARSE_STACK_MIN) {
-          results_slots = j + j / 2;
-          results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-          memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-        } else if (j >= results_slots) {
-          results_slots = j + j / 2;
-          results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
-        }
-      }
-      
-      *e = mpc_err_merge(i, *e, results[j].error);
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-        if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-    
     case MPC_TYPE_MANY1:
       
-      results = results_stk;
-      
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
-        j++;
-        if (j == MPC_PARSE_STACK_MIN) {
-          results_slots = j + j / 2;
-          results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-          memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-        } else if (j >= results_slots) {
-          results_slots = j + j / 2;
-          results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
+      if (x) {
+        MPC_RESULTS(f)[f->j++] = y;
+        if (f->j == MPC_PARSE_STACK_MIN) {
+          f->results_slots = f->j + f->j / 2;
+          f->results = mpc_malloc(i, sizeof(mpc_result_t) * f->results_slots);
+          memcpy(f->results, f->results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
+        } else if (f->j >= f->results_slots) {
+          f->results_slots = f->j + f->j / 2;
+          f->results = mpc_realloc(i, f->results, sizeof(mpc_result_t) * f->results_slots);
         }
+        MPC_CALL(p->data.repeat.x);
       }
       
-      if (j == 0) {
-        MPC_FAILURE(
-          mpc_err_many1(i, results[j].error);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
-        *e = mpc_err_merge(i, *e, results[j].error);
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      if (p->type == MPC_TYPE_MANY1 && f->j == 0) {
+        MPC_FAILURE(mpc_err_many1(i, y.error));
       }
+      
+      *e = mpc_err_merge(i, *e, y.error);
+      y.output = mpc_parse_fold(i, p->data.repeat.f, f->j, (mpc_val_t**)MPC_RESULTS(f));
+      if (f->results) { mpc_free(i, f->results); }
+      x = 1;
+      goto leave;
     
     case MPC_TYPE_COUNT:
       
-      results = p->data.repeat.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.repeat.n)
-        : results_stk;
+      results = MPC_RESULTS(f);
       
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
-        j++;
-        if (j == p->data.repeat.n) { break; }
+      if (x) {
+        results[f->j++] = y;
+        if (f->j != p->data.repeat.n) { MPC_CALL(p->data.repeat.x); }
+        y.output = mpc_parse_fold(i, p->data.repeat.f, f->j, (mpc_val_t**)results);
+        if (f->results) { mpc_free(i, f->results); }
+        x = 1;
+        goto leave;
       }
       
-      if (j == p->data.repeat.n) {
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
-        for (k = 0; k < j; k++) {
-          mpc_parse_dtor(i, p->data.repeat.dx, results[k].output);
-        }
-        MPC_FAILURE(
-          mpc_err_count(i, results[j].error, p->data.repeat.n);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });  
+      for (k = 0; k < f->j; k++) {
+        mpc_parse_dtor(i, p->data.repeat.dx, results[k].output);
       }
-      
-    /* Combinatory Parsers */
+      y.error = mpc_err_count(i, y.error, p->data.repeat.n);
+      if (f->results) { mpc_free(i, f->results); }
+      goto leave;
     
     case MPC_TYPE_OR:
       
-      if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
-      
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
+      if (x) { goto leave; }
       
-      for (j = 0; j < p->data.or.n; j++) {
-        if (mpc_parse_run(i, p->data.or.xs[j], &results[j], e)) {
-          MPC_SUCCESS(results[j].output;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-        } else {
-          *e = mpc_err_merge(i, *e, results[j].error);
-        } 
-      }
-      
-      MPC_FAILURE(NULL;
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      *e = mpc_err_merge(i, *e, y.error);
+      /* Counts and predictive parsers can fail after reading input */
+      if (f->k >= 0) { f->k = (unsigned char)mpc_input_peekc(i); }
+      f->j = mpc_parse_or_next(p, f->j + 1, f->k);
+      if (f->j == p->data.or.n) { MPC_FAILURE(NULL); }
+      MPC_CALL(p->data.or.xs[f->j]);
     
     case MPC_TYPE_AND:
       
-      if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
+      results = MPC_RESULTS(f);
       
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
-      
-      mpc_input_mark(i);
-      for (j = 0; j < p->data.and.n; j++) {
-        if (!mpc_parse_run(i, p->data.and.xs[j], &results[j], e)) {
-          mpc_input_rewind(i);
-          for (k = 0; k < j; k++) {
-            mpc_parse_dtor(i, p->data.and.dxs[k], results[k].output);
-          }
-          MPC_FAILURE(results[j].error;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      if (!x) {
+        mpc_input_rewind(i);
+        for (k = 0; k < f->j; k++) {
+          mpc_parse_dtor(i, p->data.and.dxs[k], results[k].output);
         }
+        if (f->results) { mpc_free(i, f->results); }
+        goto leave;
       }
-      mpc_input_unmark(i); 
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.and.f, j, (mpc_val_t**)results);
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-    
-    /* End */
+      
+      results[f->j++] = y;
+      if (f->j < p->data.and.n) { MPC_CALL(p->data.and.xs[f->j]); }
+      
+      mpc_input_unmark(i);
+      y.output = mpc_parse_fold(i, p->data.and.f, f->j, (mpc_val_t**)results);
+      if (f->results) { mpc_free(i, f->results); }
+      goto leave;
     
     default:
-      
-      MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
+      goto leave;
   }
   
-  return 0;
-  
 }
 
+#undef MPC_RESULTS
+#undef MPC_CALL
 #undef MPC_SUCCESS
 #undef MPC_FAILURE
 #undef MPC_PRIMITIVE
 
+/*
+** Parsing first runs with errors suppressed and
+** regexes compiled, which only changes how errors
+** are built. If it fails it is repeated from the
+** start with the combinators to report the error.
+*/
+
 int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
   int x;
-  mpc_err_t *e = mpc_err_fail(i, "Unknown Error");
+  mpc_err_t *e = NULL;
+  
+  /* The outer mark keeps piped input for the repeat */
+  mpc_input_mark(i);
+  mpc_input_mark(i);
+  mpc_input_suppress_enable(i);
+  x = mpc_parse_run(i, p, r, &e);
+  mpc_input_suppress_disable(i);
+  
+  if (x) {
+    mpc_input_unmark(i);
+    mpc_input_unmark(i);
+    r->output = mpc_export(i, r->output);
+    return x;
+  }
+  
+  mpc_err_delete_internal(i, e);
+  mpc_err_delete_internal(i, r->error);
+  mpc_input_rewind(i);
+  mpc_input_memo_clear(i);
+  i->compiled = 0;
+  
+  e = mpc_err_fail(i, "Unknown Error");
   e->state = mpc_state_invalid();
   x = mpc_parse_run(i, p, r, &e);
+  mpc_input_unmark(i);
   if (x) {
     mpc_err_delete_internal(i, e);
     r->output = mpc_export(i, r->output);
@@ -1223,6 +1552,14 @@ int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_res
   return x;
 }
 
+int mpc_nparse(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_nstring(filename, string, length);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
   int x;
   mpc_input_t *i = mpc_input_new_file(filename, file);
@@ -1241,9 +1578,30 @@ int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result
 
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
   
-  FILE *f = fopen(filename, "rb");
+  FILE *f;
   int res;
   
+#if !defined(_WIN32)
+  /* Regular files are mapped and parsed in place as string input */
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  char *s;
+  
+  if (fd >= 0) {
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+      s = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (s != MAP_FAILED) {
+        close(fd);
+        res = mpc_nparse(filename, s, st.st_size, p, r);
+        munmap(s, st.st_size);
+        return res;
+      }
+    }
+    close(fd);
+  }
+#endif
+  
+  f = fopen(filename, "rb");
   if (f == NULL) {
     r->output = NULL;
     r->error = mpc_err_file(filename, "Unable to open file!");
@@ -1268,6 +1626,7 @@ static void mpc_undefine_or(mpc_parser_t *p) {
     mpc_undefine_unretained(p->data.or.xs[i], 0);
   }
   free(p->data.or.xs);
+  free(p->data.or.first);
   
 }
 
@@ -1299,6 +1658,7 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
     case MPC_TYPE_APPLY:    mpc_undefine_unretained(p->data.apply.x, 0);    break;
     case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
     case MPC_TYPE_PREDICT:  mpc_undefine_unretained(p->data.predict.x, 0);  break;
+    case MPC_TYPE_PACKRAT:  mpc_undefine_unretained(p->data.packrat.x, 0);  break;
     
     case MPC_TYPE_MAYBE:
     case MPC_TYPE_NOT:
@@ -1319,6 +1679,12 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
     case MPC_TYPE_OR:  mpc_undefine_or(p);  break;
     case MPC_TYPE_AND: mpc_undefine_and(p); break;
     
+    case MPC_TYPE_DFA:
+      mpc_undefine_unretained(p->data.dfa.x, 0);
+      free(p->data.dfa.table);
+      free(p->data.dfa.accept);
+      break;
+    
     default: break;
   }
   
@@ -1420,6 +1786,10 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
       for (i = 0; i < a->data.or.n; i++) {
         p->data.or.xs[i] = mpc_copy(a->data.or.xs[i]);
       }
+      if (a->data.or.first) {
+        p->data.or.first = malloc(a->data.or.n * 32);
+        memcpy(p->data.or.first, a->data.or.first, a->data.or.n * 32);
+      }
     break;
     case MPC_TYPE_AND:
       p->data.and.xs = malloc(a->data.and.n * sizeof(mpc_parser_t*));
@@ -1432,6 +1802,20 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
       }
     break;
     
+    case MPC_TYPE_PACKRAT:
+      p->data.packrat.x = mpc_copy(a->data.packrat.x);
+      p->data.packrat.copy = a->data.packrat.copy;
+      p->data.packrat.dx = a->data.packrat.dx;
+    break;
+    
+    case MPC_TYPE_DFA:
+      p->data.dfa.x = mpc_copy(a->data.dfa.x);
+      p->data.dfa.table = malloc(a->data.dfa.n * 256);
+      memcpy(p->data.dfa.table, a->data.dfa.table, a->data.dfa.n * 256);
+      p->data.dfa.accept = malloc(a->data.dfa.n);
+      memcpy(p->data.dfa.accept, a->data.dfa.accept, a->data.dfa.n);
+    break;
+    
     default: break;
   }
 
@@ -1687,6 +2071,15 @@ mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
   return p;
 }
 
+mpc_parser_t *mpc_packrat(mpc_parser_t *a, mpc_apply_t copy, mpc_dtor_t da) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_PACKRAT;
+  p->data.packrat.x = a;
+  p->data.packrat.copy = copy;
+  p->data.packrat.dx = da;
+  return p;
+}
+
 mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_NOT;
@@ -2117,6 +2510,310 @@ static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
   return out;
 }
 
+/*
+** Regex DFA
+**
+** Regular expressions built from characters, classes,
+** sequences, choices and repeats are compiled into a
+** table with one transition per state and byte.
+**
+** The combinators match greedily and never backtrack
+** into a repeat, while a DFA accepts any split of the
+** input. These agree when every choice and repeat is
+** decided by the next character alone (LL(1)), so
+** only such regexes are compiled. Anchors, counted
+** repeats (which keep input when they fail) and any
+** regex needing too many states are left as they are.
+*/
+
+enum {
+  MPC_RE_NFA_MAX = 4096,
+  MPC_RE_DFA_MAX = 255
+};
+
+static int mpc_re_dfa_member(mpc_parser_t *p, char c) {
+  switch (p->type) {
+    case MPC_TYPE_ANY:    return 1;
+    case MPC_TYPE_SINGLE: return c == p->data.single.x;
+    case MPC_TYPE_RANGE:  return c >= p->data.range.x && c <= p->data.range.y;
+    case MPC_TYPE_ONEOF:  return strchr(p->data.string.x, c) != 0;
+    case MPC_TYPE_NONEOF: return strchr(p->data.string.x, c) == 0;
+    default: return 0;
+  }
+}
+
+/* Adds the first characters of p to first, returns if p can match nothing */
+static int mpc_re_dfa_first(mpc_parser_t *p, char *first) {
+  
+  int j, nullable;
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+      for (j = 0; j < 256; j++) {
+        if (mpc_re_dfa_member(p, (char)j)) { first[j] = 1; }
+      }
+      return 0;
+    
+    case MPC_TYPE_LIFT: return 1;
+    case MPC_TYPE_EXPECT: return mpc_re_dfa_first(p->data.expect.x, first);
+    
+    case MPC_TYPE_AND:
+      for (j = 0; j < p->data.and.n; j++) {
+        if (!mpc_re_dfa_first(p->data.and.xs[j], first)) { return 0; }
+      }
+      return 1;
+    
+    case MPC_TYPE_OR:
+      nullable = 0;
+      for (j = 0; j < p->data.or.n; j++) {
+        nullable = mpc_re_dfa_first(p->data.or.xs[j], first) || nullable;
+      }
+      return nullable;
+    
+    case MPC_TYPE_MAYBE: mpc_re_dfa_first(p->data.not.x, first); return 1;
+    case MPC_TYPE_MANY:  mpc_re_dfa_first(p->data.repeat.x, first); return 1;
+    case MPC_TYPE_MANY1: return mpc_re_dfa_first(p->data.repeat.x, first);
+    
+    default: return 0;
+  }
+  
+}
+
+static int mpc_re_dfa_disjoint(const char *x, const char *y) {
+  int j;
+  for (j = 0; j < 256; j++) { if (x[j] && y[j]) { return 0; } }
+  return 1;
+}
+
+/* Checks p can be compiled when followed by a character in follow */
+static int mpc_re_dfa_check(mpc_parser_t *p, const char *follow) {
+  
+  int j, k, nullable;
+  char first[256], next[256], seen[256];
+  
+  if (p->retained) { return 0; }
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+      return 1;
+    
+    case MPC_TYPE_LIFT: return p->data.lift.lf == mpcf_ctor_str;
+    case MPC_TYPE_EXPECT: return mpc_re_dfa_check(p->data.expect.x, follow);
+    
+    case MPC_TYPE_AND:
+      if (p->data.and.f != mpcf_strfold) { return 0; }
+      memcpy(next, follow, 256);
+      for (j = p->data.and.n-1; j >= 0; j--) {
+        if (!mpc_re_dfa_check(p->data.and.xs[j], next)) { return 0; }
+        memset(first, 0, 256);
+        if (!mpc_re_dfa_first(p->data.and.xs[j], first)) { memset(next, 0, 256); }
+        for (k = 0; k < 256; k++) { next[k] = next[k] || first[k]; }
+      }
+      return 1;
+    
+    case MPC_TYPE_OR:
+      /* Each choice is picked by its first character, an empty one only last */
+      memset(seen, 0, 256);
+      for (j = 0; j < p->data.or.n; j++) {
+        if (!mpc_re_dfa_check(p->data.or.xs[j], follow)) { return 0; }
+        memset(first, 0, 256);
+        nullable = mpc_re_dfa_first(p->data.or.xs[j], first);
+        if (nullable && j != p->data.or.n-1) { return 0; }
+        if (nullable) {
+          for (k = 0; k < 256; k++) { first[k] = first[k] || follow[k]; }
+        }
+        if (!mpc_re_dfa_disjoint(first, seen)) { return 0; }
+        for (k = 0; k < 256; k++) { seen[k] = seen[k] || first[k]; }
+      }
+      return 1;
+    
+    case MPC_TYPE_MAYBE:
+      if (p->data.not.lf != mpcf_ctor_str) { return 0; }
+      memset(first, 0, 256);
+      if (mpc_re_dfa_first(p->data.not.x, first)) { return 0; }
+      if (!mpc_re_dfa_disjoint(first, follow)) { return 0; }
+      return mpc_re_dfa_check(p->data.not.x, follow);
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      /* A repeat stops where its item cannot start */
+      if (p->data.repeat.f != mpcf_strfold) { return 0; }
+      memset(first, 0, 256);
+      if (mpc_re_dfa_first(p->data.repeat.x, first)) { return 0; }
+      if (!mpc_re_dfa_disjoint(first, follow)) { return 0; }
+      for (k = 0; k < 256; k++) { first[k] = first[k] || follow[k]; }
+      return mpc_re_dfa_check(p->data.repeat.x, first);
+    
+    default: return 0;
+  }
+  
+}
+
+/* Thompson NFA, states without a character are epsilon moves */
+typedef struct {
+  mpc_parser_t *c;
+  int next[2];
+} mpc_re_nfa_state_t;
+
+typedef struct {
+  int n;
+  int slots;
+  mpc_re_nfa_state_t *states;
+} mpc_re_nfa_t;
+
+static int mpc_re_nfa_add(mpc_re_nfa_t *m, mpc_parser_t *c, int x, int y) {
+  if (m->n == m->slots) {
+    m->slots = m->slots * 2;
+    m->states = realloc(m->states, sizeof(mpc_re_nfa_state_t) * m->slots);
+  }
+  m->states[m->n].c = c;
+  m->states[m->n].next[0] = x;
+  m->states[m->n].next[1] = y;
+  return m->n++;
+}
+
+/* Builds states matching p then continuing at out, returns the first one */
+static int mpc_re_nfa_build(mpc_re_nfa_t *m, mpc_parser_t *p, int out) {
+  
+  int j, s;
+  
+  if (m->n > MPC_RE_NFA_MAX) { return out; }
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_LIFT: return out;
+    case MPC_TYPE_EXPECT: return mpc_re_nfa_build(m, p->data.expect.x, out);
+    
+    case MPC_TYPE_AND:
+      for (j = p->data.and.n-1; j >= 0; j--) {
+        out = mpc_re_nfa_build(m, p->data.and.xs[j], out);
+      }
+      return out;
+    
+    case MPC_TYPE_OR:
+      s = mpc_re_nfa_build(m, p->data.or.xs[p->data.or.n-1], out);
+      for (j = p->data.or.n-2; j >= 0; j--) {
+        s = mpc_re_nfa_add(m, NULL, mpc_re_nfa_build(m, p->data.or.xs[j], out), s);
+      }
+      return s;
+    
+    case MPC_TYPE_MAYBE:
+      return mpc_re_nfa_add(m, NULL, mpc_re_nfa_build(m, p->data.not.x, out), out);
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      s = mpc_re_nfa_add(m, NULL, -1, out);
+      j = mpc_re_nfa_build(m, p->data.repeat.x, s);
+      m->states[s].next[0] = j;
+      return p->type == MPC_TYPE_MANY ? s : j;
+    
+    default: return mpc_re_nfa_add(m, p, out, -1);
+  }
+  
+}
+
+static void mpc_re_nfa_closure(mpc_re_nfa_t *m, char *set, int s) {
+  while (s >= 0 && !set[s]) {
+    set[s] = 1;
+    if (m->states[s].c) { return; }
+    mpc_re_nfa_closure(m, set, m->states[s].next[1]);
+    s = m->states[s].next[0];
+  }
+}
+
+static mpc_parser_t *mpc_re_dfa(mpc_parser_t *x) {
+  
+  int j, k, b, n, t, start;
+  char none[256];
+  char *sets, *next;
+  unsigned char *table, *shrunk, *accept;
+  mpc_re_nfa_t m;
+  mpc_parser_t *p;
+  
+  memset(none, 0, 256);
+  if (!mpc_re_dfa_check(x, none)) { return x; }
+  
+  /* NFA state 0 accepts */
+  m.n = 0;
+  m.slots = 64;
+  m.states = malloc(sizeof(mpc_re_nfa_state_t) * m.slots);
+  mpc_re_nfa_add(&m, NULL, -1, -1);
+  start = mpc_re_nfa_build(&m, x, 0);
+  
+  if (m.n > MPC_RE_NFA_MAX) { free(m.states); return x; }
+  
+  /* Subset construction, DFA state 0 is dead and 1 the start */
+  sets = calloc((MPC_RE_DFA_MAX + 1), m.n);
+  table = calloc((MPC_RE_DFA_MAX + 1), 256 * sizeof *table);
+  next = malloc(m.n);
+  if (sets == NULL || table == NULL || next == NULL) {
+    free(m.states); free(sets); free(table); free(next);
+    return x;
+  }
+  mpc_re_nfa_closure(&m, sets + m.n, start);
+  n = 2;
+  
+  for (j = 1; j < n; j++) {
+    for (b = 0; b < 256; b++) {
+      
+      memset(next, 0, m.n);
+      for (k = 0; k < m.n; k++) {
+        if (sets[j * m.n + k] && m.states[k].c
+        &&  mpc_re_dfa_member(m.states[k].c, (char)b)) {
+          mpc_re_nfa_closure(&m, next, m.states[k].next[0]);
+        }
+      }
+      
+      for (t = 0; t < n; t++) {
+        if (memcmp(sets + t * m.n, next, m.n) == 0) { break; }
+      }
+      
+      if (t == n) {
+        if (n > MPC_RE_DFA_MAX) {
+          free(m.states); free(sets); free(table); free(next);
+          return x;
+        }
+        memcpy(sets + n * m.n, next, m.n);
+        n++;
+      }
+      
+      table[j * 256 + b] = t;
+    }
+  }
+  
+  /* Sizes are computed in size_t once n is known to be positive */
+  accept = n > 0 ? malloc((size_t)n * sizeof *accept) : NULL;
+  if (accept == NULL) {
+    free(m.states); free(sets); free(table); free(next);
+    return x;
+  }
+  for (j = 0; j < n; j++) { accept[j] = sets[j * m.n]; }
+  
+  /* Shrinking may fail, the larger table is still good then */
+  shrunk = realloc(table, (size_t)n * 256 * sizeof *table);
+  if (shrunk != NULL) { table = shrunk; }
+  
+  p = mpc_undefined();
+  p->type = MPC_TYPE_DFA;
+  p->data.dfa.x = x;
+  p->data.dfa.n = n;
+  p->data.dfa.table = table;
+  p->data.dfa.accept = accept;
+  
+  free(m.states); free(sets); free(next);
+  return p;
+}
+
 mpc_parser_t *mpc_re(const char *re) {
   
   char *err_msg;
@@ -2180,7 +2877,7 @@ mpc_parser_t *mpc_re(const char *re) {
   
   mpc_optimise(r.output);
   
-  return r.output;
+  return mpc_re_dfa(r.output);
   
 }
 
@@ -2521,6 +3218,7 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_PACKRAT)  { mpc_print_unretained(p->data.packrat.x, 0); }
 
   if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
   if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
@@ -2528,6 +3226,7 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_MANY)  { mpc_print_unretained(p->data.repeat.x, 0); printf("*"); }
   if (p->type == MPC_TYPE_MANY1) { mpc_print_unretained(p->data.repeat.x, 0); printf("+"); }
   if (p->type == MPC_TYPE_COUNT) { mpc_print_unretained(p->data.repeat.x, 0); printf("{%i}", p->data.repeat.n); }
+  if (p->type == MPC_TYPE_DFA)   { mpc_print_unretained(p->data.dfa.x, 0); }
   
   if (p->type == MPC_TYPE_OR) {
     printf("(");
@@ -2631,6 +3330,7 @@ void mpc_ast_delete(mpc_ast_t *a) {
   int i;
   
   if (a == NULL) { return; }
+  if (--a->refs > 0) { return; }
   
   for (i = 0; i < a->children_num; i++) {
     mpc_ast_delete(a->children[i]);
@@ -2664,7 +3364,54 @@ mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
   
   a->children_num = 0;
   a->children = NULL;
+  a->refs = 1;
+  return a;
+  
+}
+
+static mpc_ast_t *mpc_ast_retain(mpc_ast_t *a) {
+  a->refs++;
   return a;
+}
+
+/* Node that can be changed, a shared one is replaced by a copy sharing its children */
+static mpc_ast_t *mpc_ast_unshare(mpc_ast_t *a) {
+  
+  int i;
+  mpc_ast_t *c;
+  
+  if (a->refs == 1) { return a; }
+  
+  c = mpc_ast_new(a->tag, a->contents);
+  c->state = a->state;
+  c->children_num = a->children_num;
+  if (a->children_num) {
+    c->children = malloc(sizeof(mpc_ast_t*) * a->children_num);
+    for (i = 0; i < a->children_num; i++) {
+      c->children[i] = mpc_ast_retain(a->children[i]);
+    }
+  }
+  
+  a->refs--;
+  return c;
+  
+}
+
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a) {
+  
+  int i;
+  mpc_ast_t *c = mpc_ast_new(a->tag, a->contents);
+  c->state = a->state;
+  
+  if (a->children_num == 0) { return c; }
+  
+  c->children_num = a->children_num;
+  c->children = malloc(sizeof(mpc_ast_t*) * a->children_num);
+  for (i = 0; i < a->children_num; i++) {
+    c->children[i] = mpc_ast_copy(a->children[i]);
+  }
+  
+  return c;
   
 }
 
@@ -2723,6 +3470,7 @@ mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
 
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
+  a = mpc_ast_unshare(a);
   a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
   memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
   memmove(a->tag, t, strlen(t));
@@ -2731,6 +3479,7 @@ mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
 }
 
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
+  a = mpc_ast_unshare(a);
   a->tag = realloc(a->tag, strlen(t) + 1);
   strcpy(a->tag, t);
   return a;
@@ -2738,6 +3487,7 @@ mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
 
 mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s) {
   if (a == NULL) { return a; }
+  a = mpc_ast_unshare(a);
   a->state = s;
   return a;
 }
@@ -2795,6 +3545,15 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
     
     if (as[i] && as[i]->children_num > 0) {
       
+      /* Children of a shared node are shared as well */
+      if (as[i]->refs > 1) {
+        for (j = 0; j < as[i]->children_num; j++) {
+          mpc_ast_add_child(r, mpc_ast_retain(as[i]->children[j]));
+        }
+        mpc_ast_delete(as[i]);
+        continue;
+      }
+      
       for (j = 0; j < as[i]->children_num; j++) {
         mpc_ast_add_child(r, as[i]->children[j]);
       }
@@ -2898,6 +3657,7 @@ mpc_parser_t *mpca_and(int n, ...) {
 }
 
 mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpc_total(a, (mpc_dtor_t)mpc_ast_delete); }
+mpc_parser_t *mpca_packrat(mpc_parser_t *a) { return mpc_packrat(a, (mpc_apply_t)mpc_ast_retain, (mpc_dtor_t)mpc_ast_delete); }
 
 /*
 ** Grammar Parser
@@ -3214,6 +3974,7 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
     left = mpca_grammar_find_parser(stmt->ident, st);
     if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
     if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
+    if (st->flags & MPCA_LANG_PACKRAT) { stmt->grammar = mpca_packrat(stmt->grammar); }
     mpc_optimise(stmt->grammar);
     mpc_define(left, stmt->grammar);
     free(stmt->ident);
@@ -3408,6 +4169,7 @@ static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { return 1 + mpc_nodecount_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { return 1 + mpc_nodecount_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { return 1 + mpc_nodecount_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_PACKRAT)  { return 1 + mpc_nodecount_unretained(p->data.packrat.x, 0); }
 
   if (p->type == MPC_TYPE_NOT)   { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MAYBE) { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
@@ -3436,10 +4198,210 @@ static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
   
 }
 
+/*
+** Stats are for the whole grammar, every parser
+** reachable from the one given is counted once.
+*/
+
+typedef struct {
+  int rules_num;
+  mpc_parser_t **rules;
+  int ors;
+  int dispatched;
+} mpc_stats_t;
+
+static void mpc_stats_unretained(mpc_parser_t *p, int force, mpc_stats_t *s) {
+  
+  int i;
+  
+  if (p->retained && !force) {
+    for (i = 0; i < s->rules_num; i++) {
+      if (s->rules[i] == p) { return; }
+    }
+    s->rules_num++;
+    s->rules = realloc(s->rules, sizeof(mpc_parser_t*) * s->rules_num);
+    s->rules[s->rules_num-1] = p;
+    return;
+  }
+  
+  if (p->type == MPC_TYPE_EXPECT)   { mpc_stats_unretained(p->data.expect.x, 0, s); }
+  if (p->type == MPC_TYPE_APPLY)    { mpc_stats_unretained(p->data.apply.x, 0, s); }
+  if (p->type == MPC_TYPE_APPLY_TO) { mpc_stats_unretained(p->data.apply_to.x, 0, s); }
+  if (p->type == MPC_TYPE_PREDICT)  { mpc_stats_unretained(p->data.predict.x, 0, s); }
+  if (p->type == MPC_TYPE_PACKRAT)  { mpc_stats_unretained(p->data.packrat.x, 0, s); }
+  if (p->type == MPC_TYPE_NOT)      { mpc_stats_unretained(p->data.not.x, 0, s); }
+  if (p->type == MPC_TYPE_MAYBE)    { mpc_stats_unretained(p->data.not.x, 0, s); }
+  if (p->type == MPC_TYPE_MANY)     { mpc_stats_unretained(p->data.repeat.x, 0, s); }
+  if (p->type == MPC_TYPE_MANY1)    { mpc_stats_unretained(p->data.repeat.x, 0, s); }
+  if (p->type == MPC_TYPE_COUNT)    { mpc_stats_unretained(p->data.repeat.x, 0, s); }
+  
+  if (p->type == MPC_TYPE_OR) {
+    s->ors++;
+    if (p->data.or.first) { s->dispatched++; }
+    for (i = 0; i < p->data.or.n; i++) {
+      mpc_stats_unretained(p->data.or.xs[i], 0, s);
+    }
+  }
+  
+  if (p->type == MPC_TYPE_AND) {
+    for (i = 0; i < p->data.and.n; i++) {
+      mpc_stats_unretained(p->data.and.xs[i], 0, s);
+    }
+  }
+  
+}
+
 void mpc_stats(mpc_parser_t* p) {
+  
+  int i, nodes = 0;
+  mpc_stats_t s;
+  s.rules_num = 0;
+  s.rules = NULL;
+  s.ors = 0;
+  s.dispatched = 0;
+  
+  mpc_stats_unretained(p, 0, &s);
+  for (i = 0; i < s.rules_num; i++) {
+    mpc_stats_unretained(s.rules[i], 1, &s);
+    nodes += mpc_nodecount_unretained(s.rules[i], 1);
+  }
+  
   printf("Stats\n");
   printf("=====\n");
-  printf("Node Count: %i\n", mpc_nodecount_unretained(p, 1));
+  printf("Node Count: %i\n", nodes);
+  printf("Rule Count: %i\n", s.rules_num);
+  printf("Or Count: %i\n", s.ors);
+  printf("Dispatched Or Count: %i\n", s.dispatched);
+  
+  free(s.rules);
+}
+
+/*
+** First Sets
+**
+** The characters a parser can start with and if it
+** can succeed without reading any. An `or` skips
+** the alternatives that cannot start with the next
+** character, as they would fail without reading it.
+** A rule reached again while it is being looked at
+** is taken to match anything.
+*/
+
+enum {
+  MPC_FIRST_DEPTH_MAX = 64
+};
+
+static void mpc_first_all(unsigned char *first) {
+  memset(first, 0xFF, 32);
+}
+
+static int mpc_first_unretained(mpc_parser_t *p, unsigned char *first, mpc_parser_t **stack, int depth) {
+  
+  int i, nullable;
+  
+  if (p->retained) {
+    for (i = 0; i < depth; i++) {
+      if (stack[i] == p) { mpc_first_all(first); return 1; }
+    }
+    if (depth == MPC_FIRST_DEPTH_MAX) { mpc_first_all(first); return 1; }
+    stack[depth++] = p;
+  }
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_FAIL: return 0;
+    
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+    case MPC_TYPE_STATE:
+    case MPC_TYPE_ANCHOR:
+    case MPC_TYPE_NOT:
+      return 1;
+    
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SATISFY:
+      mpc_first_all(first);
+      return 0;
+    
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+      for (i = 0; i < 256; i++) {
+        if (mpc_re_dfa_member(p, (char)i)) { first[i / 8] |= 1 << (i % 8); }
+      }
+      return 0;
+    
+    case MPC_TYPE_STRING:
+      if (p->data.string.x[0] == '\0') { return 1; }
+      i = (unsigned char)p->data.string.x[0];
+      first[i / 8] |= 1 << (i % 8);
+      return 0;
+    
+    case MPC_TYPE_DFA:
+      for (i = 0; i < 256; i++) {
+        if (p->data.dfa.table[256 + i]) { first[i / 8] |= 1 << (i % 8); }
+      }
+      return p->data.dfa.accept[1];
+    
+    case MPC_TYPE_EXPECT:   return mpc_first_unretained(p->data.expect.x, first, stack, depth);
+    case MPC_TYPE_APPLY:    return mpc_first_unretained(p->data.apply.x, first, stack, depth);
+    case MPC_TYPE_APPLY_TO: return mpc_first_unretained(p->data.apply_to.x, first, stack, depth);
+    case MPC_TYPE_PREDICT:  return mpc_first_unretained(p->data.predict.x, first, stack, depth);
+    case MPC_TYPE_PACKRAT:  return mpc_first_unretained(p->data.packrat.x, first, stack, depth);
+    
+    case MPC_TYPE_MAYBE:
+      mpc_first_unretained(p->data.not.x, first, stack, depth);
+      return 1;
+    
+    case MPC_TYPE_MANY:
+      mpc_first_unretained(p->data.repeat.x, first, stack, depth);
+      return 1;
+    
+    case MPC_TYPE_MANY1:
+      return mpc_first_unretained(p->data.repeat.x, first, stack, depth);
+    
+    case MPC_TYPE_COUNT:
+      nullable = mpc_first_unretained(p->data.repeat.x, first, stack, depth);
+      return nullable || p->data.repeat.n < 1;
+    
+    case MPC_TYPE_AND:
+      for (i = 0; i < p->data.and.n; i++) {
+        if (!mpc_first_unretained(p->data.and.xs[i], first, stack, depth)) { return 0; }
+      }
+      return 1;
+    
+    case MPC_TYPE_OR:
+      nullable = p->data.or.n == 0;
+      for (i = 0; i < p->data.or.n; i++) {
+        nullable = mpc_first_unretained(p->data.or.xs[i], first, stack, depth) || nullable;
+      }
+      return nullable;
+    
+    default:
+      mpc_first_all(first);
+      return 1;
+  }
+  
+}
+
+/* Table of 32 byte sets for each alternative, NULL when none are skipped */
+static unsigned char *mpc_first_or(mpc_parser_t *p) {
+  
+  int i, j, all = 1;
+  mpc_parser_t *stack[MPC_FIRST_DEPTH_MAX];
+  unsigned char *first = calloc(p->data.or.n, 32);
+  
+  for (i = 0; i < p->data.or.n; i++) {
+    if (mpc_first_unretained(p->data.or.xs[i], first + i * 32, stack, 0)) {
+      mpc_first_all(first + i * 32);
+    }
+    for (j = 0; j < 32; j++) { all = all && first[i * 32 + j] == 0xFF; }
+  }
+  
+  if (all) { free(first); return NULL; }
+  return first;
 }
 
 static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
@@ -3455,6 +4417,7 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { mpc_optimise_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { mpc_optimise_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { mpc_optimise_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_PACKRAT)  { mpc_optimise_unretained(p->data.packrat.x, 0); }
   if (p->type == MPC_TYPE_NOT)      { mpc_optimise_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MAYBE)    { mpc_optimise_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MANY)     { mpc_optimise_unretained(p->data.repeat.x, 0); }
@@ -3486,7 +4449,7 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       p->data.or.n = n + m - 1;
       p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
       memmove(p->data.or.xs + n - 1, t->data.or.xs, m * sizeof(mpc_parser_t*));
-      free(t->data.or.xs); free(t->name); free(t);
+      free(t->data.or.xs); free(t->data.or.first); free(t->name); free(t);
       continue;
     }
 
@@ -3498,9 +4461,9 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       n = p->data.or.n; m = t->data.or.n;
       p->data.or.n = n + m - 1;
       p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
-      memmove(p->data.or.xs + m, t->data.or.xs + 1, n * sizeof(mpc_parser_t*));
+      memmove(p->data.or.xs + m, p->data.or.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
       memmove(p->data.or.xs, t->data.or.xs, m * sizeof(mpc_parser_t*));
-      free(t->data.or.xs); free(t->name); free(t);
+      free(t->data.or.xs); free(t->data.or.first); free(t->name); free(t);
       continue;
     }
     
@@ -3603,6 +4566,12 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       continue;
     }
     
+    /* Dispatch on the next character */
+    if (p->type == MPC_TYPE_OR) {
+      free(p->data.or.first);
+      p->data.or.first = mpc_first_or(p);
+    }
+    
     return;
     
   }
@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../mpc.h"
+
+// Parses with a grammar whose alternatives share a prefix, so every rule is
+// tried again at positions it already parsed. Trees of MPCA_LANG_PACKRAT
+// must be the same as without it, also where a stored tree is tagged again
+// by the rule reusing it.
+//
+// Usage: packrat [depth]
+//
+// The nesting of the last source is given by depth. It is parsed with
+// packrat only, without it the time grows as 3 to the power of depth.
+
+#define PACKRAT_RULES 5
+
+mpc_parser_t* packrat_rules[PACKRAT_RULES];
+
+mpc_parser_t* packrat_grammar(int flags)
+{
+  mpc_parser_t* Prog  = mpc_new("prog");
+  mpc_parser_t* Expr  = mpc_new("expr");
+  mpc_parser_t* Call  = mpc_new("call");
+  mpc_parser_t* Index = mpc_new("index");
+  mpc_parser_t* Atom  = mpc_new("atom");
+  mpc_err_t* err = mpca_lang(flags,
+    "prog  : /^/ <expr> /$/ ;                                  \
+     expr  : <call> | <index> | <atom> ;                       \
+     call  : <atom> '(' <expr>? ')' ;                          \
+     index : <atom> '[' <expr> ']' ;                           \
+     atom  : /[a-z]+/ | '(' <expr> ')' ;                       ",
+    Prog, Expr, Call, Index, Atom, NULL);
+  if (err)
+    {
+      mpc_err_print(err);
+      mpc_err_delete(err);
+      exit(1);
+    }
+  packrat_rules[0] = Prog;
+  packrat_rules[1] = Expr;
+  packrat_rules[2] = Call;
+  packrat_rules[3] = Index;
+  packrat_rules[4] = Atom;
+  return Prog;
+}
+
+void packrat_cleanup(void)
+{
+  mpc_cleanup(PACKRAT_RULES, packrat_rules[0], packrat_rules[1],
+              packrat_rules[2], packrat_rules[3], packrat_rules[4]);
+}
+
+// Tree of source, or NULL after printing the error
+mpc_ast_t* packrat_parse(char* source, int flags)
+{
+  mpc_result_t r;
+  mpc_parser_t* p = packrat_grammar(flags);
+  mpc_ast_t* t = NULL;
+  if (mpc_parse("<test>", source, p, &r)) { t = r.output; }
+  else
+    {
+      mpc_err_print(r.error);
+      mpc_err_delete(r.error);
+    }
+  packrat_cleanup();
+  return t;
+}
+
+// Source nesting calls and indexing depth times around x
+char* packrat_nested(int depth)
+{
+  char* s = malloc(4 * depth + 2);
+  char* c = s;
+  for (int i = 0; i < depth; i++)
+    {
+      memcpy(c, i % 2 ? "f[" : "g(", 2);
+      c += 2;
+    }
+  *c++ = 'x';
+  for (int i = depth - 1; i >= 0; i--) { *c++ = i % 2 ? ']' : ')'; }
+  *c = '\0';
+  return s;
+}
+
+int main(int argc, char** argv)
+{
+  int depth = argc > 1 ? atoi(argv[1]) : 2000;
+  char* sources[] = { "f(x)", "f[g(x)]", "((x))(y)", "f(g[h(x)])", "f(x",
+                      "f(()", NULL };
+
+  for (int i = 0; sources[i]; i++)
+    {
+      printf("%s\n", sources[i]);
+      mpc_ast_t* a = packrat_parse(sources[i], MPCA_LANG_DEFAULT);
+      mpc_ast_t* b = packrat_parse(sources[i], MPCA_LANG_PACKRAT);
+      if (!a || !b) { printf("%s\n", a || b ? "differ" : "fail"); }
+      else if (!mpc_ast_eq(a, b)) { printf("differ\n"); }
+      else { mpc_ast_print(b); }
+      mpc_ast_delete(a);
+      mpc_ast_delete(b);
+    }
+
+  // Small enough to compare, then deep enough for packrat only
+  char* source = packrat_nested(8);
+  mpc_ast_t* a = packrat_parse(source, MPCA_LANG_DEFAULT);
+  mpc_ast_t* b = packrat_parse(source, MPCA_LANG_PACKRAT);
+  printf("depth 8 %s\n", a && b && mpc_ast_eq(a, b) ? "same" : "differ");
+  mpc_ast_delete(a);
+  mpc_ast_delete(b);
+  free(source);
+
+  source = packrat_nested(depth);
+  b = packrat_parse(source, MPCA_LANG_PACKRAT);
+  printf("depth %i %s\n", depth, b ? "parsed" : "failed");
+  mpc_ast_delete(b);
+  free(source);
+  return 0;
+}